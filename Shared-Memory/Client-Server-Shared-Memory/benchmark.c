@@ -0,0 +1,388 @@
+//
+// Contention benchmark of the process-shared lock guarding the robbery board.
+//
+// Worker processes take one lock in a loop and run a critical section of a given length under it. At the given
+// rate a worker kills itself (SIGKILL) while holding the lock, and the supervisor starts a new one in its place,
+// so the same number of workers keeps contending. Three locks are compared:
+// - robust: the PTHREAD_PROCESS_SHARED, PTHREAD_MUTEX_ROBUST mutex of the board, the kernel hands the lock of a
+//   dead owner to the next waiter with EOWNERDEAD
+// - futex: a plain futex lock holding the pid of its owner, waiters time out every millisecond to check that the
+//   owner is still alive and take the lock over if it is not
+// - spin: a test-and-test-and-set spinlock holding the pid of its owner, spinners yield and check the owner every
+//   SPIN_CHECK attempts
+// A dead owner only disappears once the supervisor reaps it, which the supervisor does as soon as it dies.
+//
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <wait.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <pthread.h>
+
+#define MAYBE_UNUSED(x) ((void)(x))
+#define ERR(source) \
+    (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
+
+#define MAX_WORKERS 4096
+#define FUTEX_WAITERS_BIT 0x80000000u // Set in the futex word when someone may sleep on it (pids fit in 22 bits)
+#define FUTEX_CHECK_NS 1000000L       // Time a futex waiter sleeps before checking that the owner is alive
+#define SPIN_CHECK 4096               // Attempts of a spinner before it yields and checks that the owner is alive
+
+typedef enum {
+    LOCK_ROBUST,
+    LOCK_FUTEX,
+    LOCK_SPIN,
+} lock_kind_t;
+
+const char *lock_names[] = {"robust", "futex", "spin"};
+
+typedef struct {
+    _Alignas(64) uint64_t acquisitions; // Critical sections completed by the processes of this worker slot
+    uint64_t recoveries;                // Locks taken over from a dead owner
+    uint64_t recovery_ns, recovery_max_ns;
+    uint64_t deaths;
+} worker_stats_t;
+
+typedef struct {
+    _Alignas(64) pthread_mutex_t mutex;
+    uint32_t futex; // Owner pid (and FUTEX_WAITERS_BIT), 0 if free
+    uint32_t spin;  // Owner pid, 0 if free
+    _Alignas(64) uint64_t counter; // Incremented non-atomically in the critical sections
+    uint64_t death_ns;             // Time the last owner killed itself
+    _Alignas(64) int stop;
+    worker_stats_t workers[MAX_WORKERS];
+} bench_t;
+
+typedef struct {
+    lock_kind_t kind;
+    int workers;
+    double kill_rate;    // Probability that an acquisition ends with the death of its owner
+    int critical_length; // Increments of the shared counter in a critical section
+    int seconds;
+} bench_args_t;
+
+void usage(char *name) {
+    fprintf(stderr, "USAGE: %s [-p processes] [-k kill rate] [-c critical section] [-s seconds] [-l lock]\n", name);
+    fprintf(stderr, "processes - contending worker processes, 1-%d (default 64)\n", MAX_WORKERS);
+    fprintf(stderr, "kill rate - probability that a worker dies holding the lock, per acquisition (default 0.001)\n");
+    fprintf(stderr, "critical section - increments of a shared counter under the lock (default 100)\n");
+    fprintf(stderr, "seconds - duration of the run of every lock (default 3)\n");
+    fprintf(stderr, "lock - robust, futex, spin or all (default all)\n");
+    exit(EXIT_FAILURE);
+}
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int owner_dead(uint32_t pid) {
+    return pid != 0 && kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+/*
+ * Locks, lock functions return 1 if the lock was taken over from a dead owner, 0 otherwise
+ */
+
+int robust_lock(bench_t *bench) {
+    int status = pthread_mutex_lock(&bench->mutex);
+    if(status == EOWNERDEAD) {
+        if(pthread_mutex_consistent(&bench->mutex) != 0)
+            ERR("pthread_mutex_consistent");
+        return 1;
+    }
+    if(status != 0)
+        ERR("pthread_mutex_lock");
+    return 0;
+}
+
+int futex_lock(bench_t *bench, uint32_t self) {
+    uint32_t value = 0;
+    if(__atomic_compare_exchange_n(&bench->futex, &value, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+    struct timespec check = {0, FUTEX_CHECK_NS};
+    for(;;) {
+        value = __atomic_load_n(&bench->futex, __ATOMIC_RELAXED);
+        if(value == 0) {
+            // Whoever else waits is still asleep, keep the waiters bit so the unlock wakes it
+            if(__atomic_compare_exchange_n(&bench->futex, &value, self | FUTEX_WAITERS_BIT, 0, __ATOMIC_ACQUIRE,
+                                           __ATOMIC_RELAXED))
+                return 0;
+            continue;
+        }
+        if(!(value & FUTEX_WAITERS_BIT)) {
+            if(!__atomic_compare_exchange_n(&bench->futex, &value, value | FUTEX_WAITERS_BIT, 0, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                continue;
+            value |= FUTEX_WAITERS_BIT;
+        }
+        if(syscall(SYS_futex, &bench->futex, FUTEX_WAIT, value, &check, NULL, 0) == -1 && errno == ETIMEDOUT &&
+           owner_dead(value & ~FUTEX_WAITERS_BIT) &&
+           __atomic_compare_exchange_n(&bench->futex, &value, self | FUTEX_WAITERS_BIT, 0, __ATOMIC_ACQUIRE,
+                                       __ATOMIC_RELAXED))
+            return 1;
+    }
+}
+
+void futex_unlock(bench_t *bench) {
+    if(__atomic_exchange_n(&bench->futex, 0, __ATOMIC_RELEASE) & FUTEX_WAITERS_BIT)
+        syscall(SYS_futex, &bench->futex, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+int spin_lock(bench_t *bench, uint32_t self) {
+    for(int attempts = 1;; attempts++) {
+        uint32_t value = __atomic_load_n(&bench->spin, __ATOMIC_RELAXED);
+        if(value == 0 &&
+           __atomic_compare_exchange_n(&bench->spin, &value, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return 0;
+        if(attempts < SPIN_CHECK) {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+            continue;
+        }
+        if(owner_dead(value) &&
+           __atomic_compare_exchange_n(&bench->spin, &value, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return 1;
+        // Start the next round of spins, the counter never grows past SPIN_CHECK
+        attempts = 0;
+        sched_yield();
+    }
+}
+
+void spin_unlock(bench_t *bench) {
+    __atomic_store_n(&bench->spin, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Workers
+ */
+
+void worker_work(bench_t *bench, bench_args_t *args, worker_stats_t *stats) {
+    uint32_t self = getpid();
+    unsigned seed = self;
+    unsigned kill_threshold = (unsigned)(args->kill_rate * RAND_MAX);
+    while(!__atomic_load_n(&bench->stop, __ATOMIC_RELAXED)) {
+        int recovered = 0;
+        switch(args->kind) {
+            case LOCK_ROBUST:
+                recovered = robust_lock(bench);
+                break;
+            case LOCK_FUTEX:
+                recovered = futex_lock(bench, self);
+                break;
+            case LOCK_SPIN:
+                recovered = spin_lock(bench, self);
+                break;
+        }
+        if(recovered) {
+            uint64_t latency = now_ns() - bench->death_ns;
+            stats->recoveries++;
+            stats->recovery_ns += latency;
+            if(latency > stats->recovery_max_ns)
+                stats->recovery_max_ns = latency;
+        }
+
+        // Die holding the lock
+        if(args->kill_rate > 0 && (unsigned)rand_r(&seed) <= kill_threshold) {
+            stats->deaths++;
+            bench->death_ns = now_ns();
+            kill(getpid(), SIGKILL);
+        }
+
+        for(int i = 0; i < args->critical_length; i++)
+            ((volatile uint64_t *)&bench->counter)[0]++;
+        stats->acquisitions++;
+
+        switch(args->kind) {
+            case LOCK_ROBUST:
+                if(pthread_mutex_unlock(&bench->mutex) != 0)
+                    ERR("pthread_mutex_unlock");
+                break;
+            case LOCK_FUTEX:
+                futex_unlock(bench);
+                break;
+            case LOCK_SPIN:
+                spin_unlock(bench);
+                break;
+        }
+    }
+    exit(EXIT_SUCCESS);
+}
+
+pid_t spawn_worker(bench_t *bench, bench_args_t *args, int slot) {
+    fflush(stdout); // The worker must not print the buffered output again when it exits
+    pid_t pid = fork();
+    if(pid == -1)
+        ERR("fork");
+    if(pid == 0)
+        worker_work(bench, args, &bench->workers[slot]);
+    return pid;
+}
+
+/*
+ * Supervisor
+ */
+
+void run(bench_args_t *args) {
+    bench_t *bench = mmap(NULL, sizeof(bench_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(bench == MAP_FAILED)
+        ERR("mmap");
+    pthread_mutexattr_t attr;
+    if(pthread_mutexattr_init(&attr) != 0)
+        ERR("pthread_mutexattr_init");
+    if(pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) != 0)
+        ERR("pthread_mutexattr_setpshared");
+    if(pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) != 0)
+        ERR("pthread_mutexattr_setrobust");
+    if(pthread_mutex_init(&bench->mutex, &attr) != 0)
+        ERR("pthread_mutex_init");
+    if(pthread_mutexattr_destroy(&attr) != 0)
+        ERR("pthread_mutexattr_destroy");
+
+    pid_t *pids = malloc(args->workers * sizeof(pid_t));
+    if(pids == NULL)
+        ERR("malloc");
+    uint64_t start = now_ns(), end = start + (uint64_t)args->seconds * 1000000000ull;
+    for(int i = 0; i < args->workers; i++)
+        pids[i] = spawn_worker(bench, args, i);
+
+    // Reap the workers as soon as they die (SIGCHLD is blocked) and start new ones in their slots
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    int running = args->workers, stopped = 0;
+    uint64_t now = start;
+    while(running > 0) {
+        // Stop the run at the deadline, workers dying from now on are not replaced
+        if(!stopped && now >= end) {
+            __atomic_store_n(&bench->stop, 1, __ATOMIC_RELAXED);
+            stopped = 1;
+        }
+        if(!stopped) {
+            struct timespec timeout = {(end - now) / 1000000000ull, (end - now) % 1000000000ull};
+            if(sigtimedwait(&mask, NULL, &timeout) == -1 && errno != EAGAIN && errno != EINTR)
+                ERR("sigtimedwait");
+        }
+        pid_t pid;
+        int status;
+        while((pid = waitpid(-1, &status, stopped ? 0 : WNOHANG)) > 0) {
+            int slot = 0;
+            while(slot < args->workers && pids[slot] != pid)
+                slot++;
+            if(slot < args->workers && WIFSIGNALED(status) && !stopped)
+                pids[slot] = spawn_worker(bench, args, slot);
+            else if(slot < args->workers)
+                running--;
+            // Workers may die faster than they are replaced, the deadline must still be noticed
+            if(!stopped && (now = now_ns()) >= end)
+                break;
+        }
+        if(pid == -1 && errno != ECHILD)
+            ERR("waitpid");
+        if(!stopped)
+            now = now_ns();
+    }
+    double elapsed = (end - start) / 1e9;
+
+    // Aggregate the slots: throughput, recovery latency and fairness (Jain's index over the slots)
+    uint64_t acquisitions = 0, recoveries = 0, deaths = 0, recovery_ns = 0, recovery_max_ns = 0;
+    uint64_t min = UINT64_MAX, max = 0;
+    double squares = 0;
+    for(int i = 0; i < args->workers; i++) {
+        worker_stats_t *stats = &bench->workers[i];
+        acquisitions += stats->acquisitions;
+        recoveries += stats->recoveries;
+        deaths += stats->deaths;
+        recovery_ns += stats->recovery_ns;
+        if(stats->recovery_max_ns > recovery_max_ns)
+            recovery_max_ns = stats->recovery_max_ns;
+        if(stats->acquisitions < min)
+            min = stats->acquisitions;
+        if(stats->acquisitions > max)
+            max = stats->acquisitions;
+        squares += (double)stats->acquisitions * stats->acquisitions;
+    }
+    double fairness = squares > 0 ? (double)acquisitions * acquisitions / (args->workers * squares) : 1;
+    int exclusive = bench->counter == acquisitions * (uint64_t)args->critical_length;
+
+    printf("%-6s | %12.0f | %6" PRIu64 " / %-6" PRIu64 " | %10.1f | %10.1f | %8.3f | %8" PRIu64 " | %8" PRIu64 " | %s\n", lock_names[args->kind],
+           acquisitions / elapsed, recoveries, deaths, recoveries ? recovery_ns / 1e3 / recoveries : 0.0,
+           recovery_max_ns / 1e3, fairness, min, max, exclusive ? "ok" : "VIOLATED");
+
+    free(pids);
+    // A worker killed while holding the mutex leaves it busy, which is expected here
+    int error = pthread_mutex_destroy(&bench->mutex);
+    if(error != 0 && error != EBUSY) {
+        errno = error;
+        ERR("pthread_mutex_destroy");
+    }
+    if(munmap(bench, sizeof(bench_t)) == -1)
+        ERR("munmap");
+}
+
+int main(int argc, char *argv[]) {
+    bench_args_t args = {LOCK_ROBUST, 64, 0.001, 100, 3};
+    int all = 1, opt;
+    while((opt = getopt(argc, argv, "p:k:c:s:l:")) != -1) {
+        switch(opt) {
+            case 'p':
+                if((args.workers = atoi(optarg)) < 1 || args.workers > MAX_WORKERS)
+                    usage(argv[0]);
+                break;
+            case 'k':
+                if((args.kill_rate = atof(optarg)) < 0 || args.kill_rate > 1)
+                    usage(argv[0]);
+                break;
+            case 'c':
+                if((args.critical_length = atoi(optarg)) < 0)
+                    usage(argv[0]);
+                break;
+            case 's':
+                if((args.seconds = atoi(optarg)) < 1)
+                    usage(argv[0]);
+                break;
+            case 'l':
+                all = strcmp(optarg, "all") == 0;
+                for(args.kind = LOCK_ROBUST; !all && strcmp(optarg, lock_names[args.kind]) != 0; args.kind++)
+                    if(args.kind == LOCK_SPIN)
+                        usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(optind != argc)
+        usage(argv[0]);
+
+    // SIGCHLD is only collected with sigtimedwait, the workers inherit the mask but never wait for it
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if(sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+        ERR("sigprocmask");
+
+    printf("%d processes, kill rate %g, critical section %d, %d s per lock\n", args.workers, args.kill_rate,
+           args.critical_length, args.seconds);
+    printf("lock   | acquisitions/s | recovered/died | mean rec. us | max rec. us | fairness | min      | max      | exclusion\n");
+    if(all)
+        for(args.kind = LOCK_ROBUST; args.kind <= LOCK_SPIN; args.kind++)
+            run(&args);
+    else
+        run(&args);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,281 @@
+//
+// Layout of the shared board of the robbery simulation, used by both the server and the clients.
+//
+// The segment starts with a versioned header (board_t) and the grid follows it at header->cells_offset, n * n
+// cells row by row; the size of the segment is derived from n, so clients map it whole after checking the magic
+// number and version. Grids of BOARD_HUGE_PAGE bytes or more are padded to whole huge pages and advised to be
+// backed by transparent huge pages, which keeps million-cell grids from thrashing the TLB.
+//
+// The rows of the grid are guarded by BOARD_STRIPES robust, process-shared mutexes: row r is guarded by stripe
+// r % BOARD_STRIPES, so clients searching different rows never wait for each other. A client dying while it
+// holds a stripe only leaves that stripe to be recovered (EOWNERDEAD), the rest of the board is unaffected.
+//
+// Every stripe also carries a sequence number, odd while a writer holding the stripe changes its rows (a seqlock),
+// so the server takes snapshots of the grid without locking anything: it copies the rows of a stripe and retries
+// only if the sequence number moved meanwhile. A stripe left odd by a dead writer is copied under its mutex, which
+// recovers it.
+//
+// Nobody polls the board on a timer: clients bump the generation number of the header after every change, and
+// the server sleeps on it with a futex until it moves, so it shows every change as soon as it happens. Clients
+// only ever wait for a stripe, whose robust mutex also sleeps in a futex until the stripe is released.
+//
+// The header also holds a table of BOARD_MAX_CLIENTS statistics slots, one cache line each. A client claims a free
+// slot for its pid when it joins and is then its only writer (with relaxed atomics, no lock), and the slot outlives
+// the client, so the server shows a leaderboard of every client that played, disconnected ones included.
+//
+
+#ifndef SHARED_MEMORY_BOARD_H
+#define SHARED_MEMORY_BOARD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <pthread.h>
+
+#define BOARD_MAGIC 0x424f4252u // "RBOB"
+#define BOARD_VERSION 4
+#define BOARD_STRIPES 16
+#define BOARD_MAX_N 65536         // Largest grid side, 4 GiB of cells
+#define BOARD_HUGE_PAGE (2 << 20) // Transparent huge page size on x86-64 and arm64 (4 KiB base pages)
+#define BOARD_CELLS_ALIGNMENT 64  // Cache line the grid starts on
+#define BOARD_SNAPSHOT_RETRIES 64 // Lock-free copies of a stripe attempted before copying it under its mutex
+#define BOARD_MAX_CLIENTS 1024    // Statistics slots, clients joining once they are all taken play without one
+
+typedef enum {
+    CLIENT_PLAYING,
+    CLIENT_GAME_OVER,    // Found a zero
+    CLIENT_DISCONNECTED, // Left the game at random
+} client_state_t;
+
+typedef struct {
+    _Alignas(64) int32_t pid; // 0 while the slot is free
+    uint32_t state;           // client_state_t
+    uint64_t score;
+    uint64_t moves;
+    uint64_t zeros; // Searches of a cell that was already visited
+} board_client_t;
+
+typedef struct {
+    _Alignas(64) pthread_mutex_t mutex; // Own cache line, so clients on other stripes do not share it
+    uint32_t sequence;                  // Odd while a writer changes the rows of the stripe
+} board_stripe_t;
+
+typedef struct {
+    uint32_t magic;        // BOARD_MAGIC, written last by the server once the board is initialized
+    uint32_t version;      // BOARD_VERSION
+    uint64_t n;            // Side of the grid
+    uint64_t cells_offset; // Offset of the grid from the start of the segment
+    uint64_t size;         // Size of the whole segment
+    _Alignas(64) uint32_t generation; // Futex word, bumped after every change of the grid
+    uint32_t waiters;                 // Processes sleeping on the generation
+    board_stripe_t stripes[BOARD_STRIPES];
+    board_client_t clients[BOARD_MAX_CLIENTS];
+} board_t;
+
+// Offset of the grid from the start of the segment
+uint64_t board_cells_offset(void) {
+    return (sizeof(board_t) + BOARD_CELLS_ALIGNMENT - 1) / BOARD_CELLS_ALIGNMENT * BOARD_CELLS_ALIGNMENT;
+}
+
+// Size of the segment holding a grid of side n
+uint64_t board_size(uint64_t n) {
+    uint64_t size = board_cells_offset() + n * n;
+    uint64_t page = size >= BOARD_HUGE_PAGE ? BOARD_HUGE_PAGE : (uint64_t)sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+// Cell (x, y) of the grid
+char *board_cell(board_t *board, int x, int y) {
+    return (char *)board + board->cells_offset + (uint64_t)x * board->n + y;
+}
+
+// Ask for transparent huge pages for a large board, the kernel may only honor it for shared memory when
+// /sys/kernel/mm/transparent_hugepage/shmem_enabled is "advise" or "always"
+void board_advise_huge_pages(board_t *board) {
+    if(board->size >= BOARD_HUGE_PAGE && madvise(board, board->size, MADV_HUGEPAGE) == -1 && errno != EINVAL)
+        perror("madvise");
+}
+
+// Stripe guarding a row of the grid
+board_stripe_t *board_stripe(board_t *board, int row) {
+    return &board->stripes[row % BOARD_STRIPES];
+}
+
+// Lock a stripe, making it consistent again if its owner died while holding it (in the middle of a write too)
+// Returns 0 on success, the error of pthread_mutex_lock otherwise
+int board_lock(board_stripe_t *stripe) {
+    int status = pthread_mutex_lock(&stripe->mutex);
+    if(status == EOWNERDEAD) {
+        printf("Recovering from a disconnected client\n");
+        if(__atomic_load_n(&stripe->sequence, __ATOMIC_RELAXED) & 1)
+            __atomic_store_n(&stripe->sequence, stripe->sequence + 1, __ATOMIC_RELEASE);
+        status = pthread_mutex_consistent(&stripe->mutex);
+    }
+    return status;
+}
+
+int board_unlock(board_stripe_t *stripe) {
+    return pthread_mutex_unlock(&stripe->mutex);
+}
+
+// Start changing the rows of a stripe, which must be locked
+void board_write_begin(board_stripe_t *stripe) {
+    __atomic_store_n(&stripe->sequence, stripe->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// Done changing the rows of a stripe
+void board_write_end(board_stripe_t *stripe) {
+    __atomic_store_n(&stripe->sequence, stripe->sequence + 1, __ATOMIC_RELEASE);
+}
+
+// Search a cell and mark it as visited, between board_write_begin and board_write_end
+// Returns the number the cell held
+int board_take(board_t *board, int x, int y) {
+    char *cell = board_cell(board, x, y);
+    int num = __atomic_load_n(cell, __ATOMIC_RELAXED);
+    __atomic_store_n(cell, 0, __ATOMIC_RELAXED);
+    return num;
+}
+
+// Tell the processes waiting for the grid to change that it did
+void board_notify(board_t *board) {
+    // Sequentially consistent on both sides: either the waiter sees the new generation, or this sees the waiter
+    __atomic_add_fetch(&board->generation, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&board->waiters, __ATOMIC_SEQ_CST) > 0)
+        syscall(SYS_futex, &board->generation, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Sleep until the generation of the grid moves past the given one
+// Returns the new generation
+uint32_t board_wait(board_t *board, uint32_t generation) {
+    __atomic_add_fetch(&board->waiters, 1, __ATOMIC_SEQ_CST);
+    uint32_t current;
+    while((current = __atomic_load_n(&board->generation, __ATOMIC_SEQ_CST)) == generation)
+        if(syscall(SYS_futex, &board->generation, FUTEX_WAIT, generation, NULL, NULL, 0) == -1 &&
+           errno != EAGAIN && errno != EINTR)
+            perror("futex");
+    __atomic_sub_fetch(&board->waiters, 1, __ATOMIC_SEQ_CST);
+    return current;
+}
+
+// Claim a statistics slot for the calling process
+// Returns the slot, NULL if they are all taken
+board_client_t *board_join(board_t *board) {
+    for(int i = 0; i < BOARD_MAX_CLIENTS; i++) {
+        board_client_t *client = &board->clients[i];
+        int32_t free_pid = 0;
+        if(__atomic_load_n(&client->pid, __ATOMIC_RELAXED) == 0 &&
+           __atomic_compare_exchange_n(&client->pid, &free_pid, getpid(), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return client;
+    }
+    return NULL;
+}
+
+// Record a move in the slot of the calling process, which is its only writer; finding a zero ends the game
+void board_record_move(board_client_t *client, int num) {
+    if(client == NULL)
+        return;
+    __atomic_store_n(&client->moves, client->moves + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&client->score, client->score + num, __ATOMIC_RELAXED);
+    if(num == 0) {
+        __atomic_store_n(&client->zeros, client->zeros + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&client->state, CLIENT_GAME_OVER, __ATOMIC_RELAXED);
+    }
+}
+
+void board_set_state(board_client_t *client, client_state_t state) {
+    if(client != NULL)
+        __atomic_store_n(&client->state, state, __ATOMIC_RELAXED);
+}
+
+// Copy the rows of a stripe, racing its writers
+void board_copy_stripe(board_t *board, int stripe, char *snapshot) {
+    uint64_t n = board->n;
+    for(uint64_t row = stripe; row < n; row += BOARD_STRIPES)
+        for(uint64_t j = 0; j < n; j++)
+            snapshot[row * n + j] = __atomic_load_n(board_cell(board, row, j), __ATOMIC_RELAXED);
+}
+
+// Copy the grid without taking the stripes, every stripe is copied between two of its writes
+// Returns 0 on success, the error of pthread_mutex_lock if a stripe had to be locked and could not be
+int board_snapshot(board_t *board, char *snapshot) {
+    for(int i = 0; i < BOARD_STRIPES; i++) {
+        board_stripe_t *stripe = &board->stripes[i];
+        int copied = 0;
+        for(int attempt = 0; attempt < BOARD_SNAPSHOT_RETRIES && !copied; attempt++) {
+            uint32_t sequence = __atomic_load_n(&stripe->sequence, __ATOMIC_ACQUIRE);
+            if(sequence & 1)
+                continue; // A writer is in the middle of a change
+            board_copy_stripe(board, i, snapshot);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            copied = __atomic_load_n(&stripe->sequence, __ATOMIC_RELAXED) == sequence;
+        }
+        if(copied)
+            continue;
+
+        // Writers keep racing the copy, or one died in the middle of a change: copy under the mutex
+        int status;
+        if((status = board_lock(stripe)) != 0)
+            return status;
+        board_copy_stripe(board, i, snapshot);
+        if((status = board_unlock(stripe)) != 0)
+            return status;
+    }
+    return 0;
+}
+
+// Initialize the header and the stripes (robust, process-shared mutexes) of a new board, but not its magic number
+// Returns 0 on success, the error of the failed call otherwise
+int board_init(board_t *board, uint64_t n) {
+    board->version = BOARD_VERSION;
+    board->n = n;
+    board->cells_offset = board_cells_offset();
+    board->size = board_size(n);
+    board->generation = 0;
+    board->waiters = 0;
+    memset(board->clients, 0, sizeof(board->clients));
+
+    pthread_mutexattr_t attr;
+    int status;
+    if((status = pthread_mutexattr_init(&attr)) != 0)
+        return status;
+    if((status = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED)) == 0 &&
+       (status = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST)) == 0)
+        for(int i = 0; i < BOARD_STRIPES && status == 0; i++)
+        {
+            status = pthread_mutex_init(&board->stripes[i].mutex, &attr);
+            board->stripes[i].sequence = 0;
+        }
+    pthread_mutexattr_destroy(&attr);
+    return status;
+}
+
+// Publish an initialized board to the clients
+void board_publish(board_t *board) {
+    __atomic_store_n(&board->magic, BOARD_MAGIC, __ATOMIC_RELEASE);
+}
+
+// Check that a mapped segment holds a board this program understands
+// Returns 1 if it does, 0 otherwise
+int board_check(board_t *board, uint64_t mapped_size) {
+    return mapped_size >= sizeof(board_t) && __atomic_load_n(&board->magic, __ATOMIC_ACQUIRE) == BOARD_MAGIC &&
+           board->version == BOARD_VERSION && board->size == mapped_size && board->n <= BOARD_MAX_N &&
+           board->cells_offset >= sizeof(board_t) && board->cells_offset + board->n * board->n <= board->size;
+}
+
+// Destroy the stripes, no client may use the board anymore
+int board_destroy(board_t *board) {
+    int status = 0;
+    for(int i = 0; i < BOARD_STRIPES && status == 0; i++)
+        status = pthread_mutex_destroy(&board->stripes[i].mutex);
+    return status;
+}
+
+#endif // SHARED_MEMORY_BOARD_H
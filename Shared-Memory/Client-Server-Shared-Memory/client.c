@@ -12,15 +12,18 @@
 #include <sys/mman.h>
 #include <memory.h>
 #include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "board.h"
 
 #define MAYBE_UNUSED(x) ((void)(x))
 #define ERR(source) \
     (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
-#define SHM_SIZE 4096
 
 void usage(char *name) {
-    fprintf(stderr, "USAGE: %s <pid>\n", name);
+    fprintf(stderr, "USAGE: %s <pid> [delay]\n", name);
     fprintf(stderr, "pid - pid of the server\n");
+    fprintf(stderr, "delay - milliseconds between two moves (default 0, as fast as the other clients let it)\n");
     exit(EXIT_FAILURE);
 }
 int main(int argc, char* argv[]) {
@@ -28,11 +31,14 @@ int main(int argc, char* argv[]) {
      * Input validation
      */
 
-    if(argc != 2)
+    if(argc != 2 && argc != 3)
         usage(argv[0]);
     pid_t server_pid = atoi(argv[1]);
     if(server_pid <= 0)
         ERR("Invalid pid");
+    int delay_ms = argc == 3 ? atoi(argv[2]) : 0;
+    if(delay_ms < 0)
+        usage(argv[0]);
 
     /*
      * Shared memory opening
@@ -48,51 +54,60 @@ int main(int argc, char* argv[]) {
      * Shared memory mapping
      */
 
-    int *grid;
-    if((grid = (int*)mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0)) == MAP_FAILED)
+    // The size of the segment follows from the grid, map all of it
+    struct stat shm_stat;
+    if(fstat(shm_fd, &shm_stat) == -1)
+        ERR("fstat");
+    uint64_t shm_size = shm_stat.st_size;
+    board_t *board;
+    if(shm_size == 0 ||
+       (board = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0)) == MAP_FAILED)
         ERR("mmap");
 
     // Close the shared memory file descriptor
     if(close(shm_fd) == -1)
         ERR("close");
-    // Get the shared mutex
-    pthread_mutex_t *shared_mutex = (pthread_mutex_t*)grid;
-    char* n_shared = (char *) grid + sizeof(pthread_mutex_t);
-    int n = *n_shared;
-    char* grid_start = n_shared + sizeof(char);
+    if(!board_check(board, shm_size)) {
+        fprintf(stderr, "%s is not a board of this version, or the server is not ready yet\n", shm_name);
+        exit(EXIT_FAILURE);
+    }
+    board_advise_huge_pages(board);
+    int n = board->n;
     /*
      * Client work
      */
     srand(getpid());
 
+    // Claim a statistics slot, the score stays on the board after the client is gone
+    board_client_t *slot = board_join(board);
+    if(slot == NULL)
+        printf("Client %d plays without a statistics slot, all %d are taken\n", getpid(), BOARD_MAX_CLIENTS);
+
     int score = 0;
     int should_run = 1;
     while(should_run) {
-        // Lock the shared mutex
-        int status;
-        if( (status = pthread_mutex_lock(shared_mutex)) != 0) {
-            if(status == EOWNERDEAD){
-                pthread_mutex_consistent(shared_mutex);
-                printf("Recovering from a disconnected client\n");
-            }else{
-                ERR("pthread_mutex_lock");
-            }
-        }
+        // Pick a random move and lock the stripe of its row only
+        int x = rand() % n;
+        int y = rand() % n;
+        board_stripe_t *stripe = board_stripe(board, x);
+        if(board_lock(stripe) != 0)
+            ERR("pthread_mutex_lock");
 
-        // Randomly disconnect the client
+        // Randomly disconnect the client, leaving the stripe to be recovered by the next one taking it
         int D = 1 + rand() % 9;
         if(D == 1) {
+            board_set_state(slot, CLIENT_DISCONNECTED);
+            board_notify(board);
             printf("Client %d disconnected\n", getpid());
             exit(EXIT_SUCCESS);
         }
 
-        // Make a random move
-        int x = rand() % n;
-        int y = rand() % n;
-
         printf("Client %d tries to search field (%d, %d)\n", getpid(), x, y);
-        int num = grid_start[x * n + y];
-        grid_start[x * n + y] = 0; // Mark the field as visited
+        board_write_begin(stripe);
+        int num = board_take(board, x, y); // Marks the field as visited
+        board_write_end(stripe);
+        board_record_move(slot, num);
+        board_notify(board);
         score += num;
         printf("Client %d found %d at (%d, %d)\n", getpid(), num, x, y);
         // Disconnect the client if the number is 0 else add the number to the score
@@ -102,17 +117,19 @@ int main(int argc, char* argv[]) {
             should_run = 0;
         }
 
-        // Unlock the shared mutex
-        if (pthread_mutex_unlock(shared_mutex)) ERR("pthread_mutex_unlock");
+        // Unlock the stripe
+        if (board_unlock(stripe)) ERR("pthread_mutex_unlock");
 
-        for(int i = sleep(1); i > 0; i = sleep(i)); // Sleep for 1 second
+        // The next move waits for nothing but its stripe, unless a delay was asked for
+        struct timespec delay = {delay_ms / 1000, delay_ms % 1000 * 1000000L};
+        while(delay_ms > 0 && nanosleep(&delay, &delay) == -1 && errno == EINTR);
     }
 
     /*
      * Cleanup
      */
 
-    if(munmap(grid, SHM_SIZE) == -1)
+    if(munmap(board, shm_size) == -1)
         ERR("munmap");
     exit(EXIT_SUCCESS);
 }
@@ -12,18 +12,21 @@
 #include <sys/mman.h>
 #include <memory.h>
 #include <pthread.h>
+#include <inttypes.h>
+#include "board.h"
 
 #define MAYBE_UNUSED(x) ((void)(x))
 #define ERR(source) \
     (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
 
-#define SHM_SIZE 4096
+#define LEADERBOARD_SIZE 5
 
 typedef struct
 {
     int running;
     pthread_mutex_t mutex;
     sigset_t old_mask, new_mask;
+    board_t *board; // Woken up to notice the server is stopping
 } sighandling_args_t;
 
 void* sighandling(void* args)
@@ -40,15 +43,56 @@ void* sighandling(void* args)
     pthread_mutex_lock(&sighandling_args->mutex);
     sighandling_args->running = 0;
     pthread_mutex_unlock(&sighandling_args->mutex);
+    board_notify(sighandling_args->board);
     return NULL;
 }
 void usage(char *name) {
     fprintf(stderr, "USAGE: %s <n>\n", name);
-    fprintf(stderr, "n - size of the grid\n");
+    fprintf(stderr, "n - size of the grid, 1-%d\n", BOARD_MAX_N);
     exit(EXIT_FAILURE);
 }
 
-void parent_work(int n, char *grid, sighandling_args_t *sighandling_args, pthread_mutex_t *shared_mutex) {
+// Print the totals of the statistics slots and the best clients, reading the slots without any lock
+void print_leaderboard(board_t *board) {
+    const char *states[] = {"playing", "game over", "disconnected"};
+    int leaders[LEADERBOARD_SIZE], n_leaders = 0, n_clients = 0;
+    uint64_t scores[LEADERBOARD_SIZE], moves = 0, zeros = 0;
+    for(int i = 0; i < BOARD_MAX_CLIENTS; i++) {
+        board_client_t *client = &board->clients[i];
+        if(__atomic_load_n(&client->pid, __ATOMIC_RELAXED) == 0)
+            continue;
+        n_clients++;
+        moves += __atomic_load_n(&client->moves, __ATOMIC_RELAXED);
+        zeros += __atomic_load_n(&client->zeros, __ATOMIC_RELAXED);
+
+        // Insert the client into the leaders, kept sorted by decreasing score
+        uint64_t score = __atomic_load_n(&client->score, __ATOMIC_RELAXED);
+        int k = n_leaders < LEADERBOARD_SIZE ? n_leaders++ : LEADERBOARD_SIZE;
+        for(; k > 0 && scores[k - 1] < score; k--)
+            if(k < LEADERBOARD_SIZE) {
+                leaders[k] = leaders[k - 1];
+                scores[k] = scores[k - 1];
+            }
+        if(k < LEADERBOARD_SIZE) {
+            leaders[k] = i;
+            scores[k] = score;
+        }
+    }
+    printf("Clients: %d, moves: %" PRIu64 ", zeros found: %" PRIu64 "\n", n_clients, moves, zeros);
+    for(int k = 0; k < n_leaders; k++) {
+        board_client_t *client = &board->clients[leaders[k]];
+        uint32_t state = __atomic_load_n(&client->state, __ATOMIC_RELAXED);
+        printf("%d. client %d: %" PRIu64 " (%s)\n", k + 1, __atomic_load_n(&client->pid, __ATOMIC_RELAXED), scores[k],
+               state <= CLIENT_DISCONNECTED ? states[state] : "?");
+    }
+    printf("\n");
+}
+
+void parent_work(int n, board_t *board, sighandling_args_t *sighandling_args) {
+    char *snapshot = malloc((size_t)n * n);
+    if(snapshot == NULL)
+        ERR("malloc");
+    uint32_t generation = __atomic_load_n(&board->generation, __ATOMIC_SEQ_CST);
     while(1){
         // Check if the server is still running
         pthread_mutex_lock(&sighandling_args->mutex);
@@ -56,32 +100,21 @@ void parent_work(int n, char *grid, sighandling_args_t *sighandling_args, pthrea
             break;
         pthread_mutex_unlock(&sighandling_args->mutex);
 
-        // Handle disconnected clients
-        int status;
-        if( (status = pthread_mutex_lock(shared_mutex)) != 0) {
-            if(status == EOWNERDEAD){
-                pthread_mutex_consistent(shared_mutex);
-                printf("Recovering from a disconnected client\n");
-            }else{
-                ERR("pthread_mutex_lock");
-            }
-        }
-
-        // Print the grid
+        // Snapshot the grid without blocking the clients, then print it with no lock held
+        if(board_snapshot(board, snapshot) != 0)
+            ERR("pthread_mutex_lock");
         for (int i = 0; i < n; i++) {
             for (int j = 0; j < n; j++)
-                printf("%d ", grid[i * n + j]);
+                printf("%d ", snapshot[(size_t)i * n + j]);
             printf("\n");
         }
         printf("\n");
+        print_leaderboard(board);
 
-        // Unlock the mutex
-        if(pthread_mutex_unlock(shared_mutex) != 0)
-            ERR("pthread_mutex_unlock");
-
-        // Sleep for 3 seconds
-        for(int i = sleep(3); i > 0; i = sleep(i));
+        // Sleep until a client changes the grid (or the server is stopped), changes meanwhile are shown together
+        generation = board_wait(board, generation);
     }
+    free(snapshot);
 }
 
 int main(int argc, char *argv[]) {
@@ -93,7 +126,7 @@ int main(int argc, char *argv[]) {
     if(argc != 2)
         usage(argv[0]);
     int n = atoi(argv[1]);
-    if(n <= 0)
+    if(n <= 0 || n > BOARD_MAX_N)
         usage(argv[0]);
 
     /*
@@ -118,55 +151,46 @@ int main(int argc, char *argv[]) {
     if(shm_fd == -1)
         ERR("shm_open");
 
-    int grid_size = n * n;
-    if(ftruncate(shm_fd, SHM_SIZE) == -1)
+    // Size the segment for the grid
+    uint64_t shm_size = board_size(n);
+    if(ftruncate(shm_fd, shm_size) == -1)
         ERR("ftruncate");
 
-    // Map shared memory
-    int *grid = mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-    if(grid == MAP_FAILED)
+    // Map shared memory, backing a large grid with huge pages before it is first touched
+    board_t *board = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if(board == MAP_FAILED)
         ERR("mmap");
+    board->size = shm_size;
+    board_advise_huge_pages(board);
 
     // Close the file descriptor
     if(close(shm_fd) == -1)
         ERR("close");
 
     /*
-     * Shared mutex
+     * Shared mutexes
      */
 
-    // Set the shared_mutex attr to PTHREAD_PROCESS_SHARED and PTHREAD_MUTEX_ROBUST
-    pthread_mutexattr_t attr;
-    if(pthread_mutexattr_init(&attr) != 0)
-        ERR("pthread_mutexattr_init");
-    if(pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) != 0)
-        ERR("pthread_mutexattr_setpshared");
-    if(pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) != 0)
-        ERR("pthread_mutexattr_setrobust");
-
-    // Initialize shared_mutex
-    pthread_mutex_t *shared_mutex = (pthread_mutex_t *) grid;
-    if(pthread_mutex_init(shared_mutex, &attr) != 0)
+    // Initialize the header and the row stripes as PTHREAD_PROCESS_SHARED and PTHREAD_MUTEX_ROBUST mutexes
+    if(board_init(board, n) != 0)
         ERR("pthread_mutex_init");
 
     /*
      * Grid
      */
 
-    // Initialize the grid
-    char* n_shared = (char *) grid + sizeof(pthread_mutex_t);
-    n_shared[0] = n;
-    char* grid_start = n_shared + sizeof(char);
-
-    for(int i = 0; i < grid_size; i++)
-        grid_start[i] = rand() % 9 + 1;
+    // Initialize the grid, then let the clients in
+    for(int i = 0; i < n; i++)
+        for(int j = 0; j < n; j++)
+            *board_cell(board, i, j) = rand() % 9 + 1;
+    board_publish(board);
 
     /*
      * Signal handling thread
      */
 
     // Initialize sighandling thread, and its args
-    sighandling_args_t sighandling_args = {1, PTHREAD_MUTEX_INITIALIZER, {0}, {0}};
+    sighandling_args_t sighandling_args = {1, PTHREAD_MUTEX_INITIALIZER, {{0}}, {{0}}, board};
     sigemptyset(&sighandling_args.new_mask);
     sigaddset(&sighandling_args.new_mask, SIGINT);
     // Block SIGINT in the main thread
@@ -180,7 +204,7 @@ int main(int argc, char *argv[]) {
      * Main loop
      */
 
-    parent_work(n, grid_start, &sighandling_args, shared_mutex);
+    parent_work(n, board, &sighandling_args);
 
     /*
      * Cleanup
@@ -189,14 +213,11 @@ int main(int argc, char *argv[]) {
     // Join the sighandling thread
     if(pthread_join(sighandling_thread, NULL) != 0)
         ERR("pthread_join");
-    // Destroy the shared mutex
-    if(pthread_mutex_destroy(shared_mutex) != 0)
+    // Destroy the shared mutexes
+    if(board_destroy(board) != 0)
         ERR("pthread_mutex_destroy");
-    // Destroy the shared mutex attr
-    if(pthread_mutexattr_destroy(&attr) != 0)
-        ERR("pthread_mutexattr_destroy");
     // Unmap the shared memory
-    if(munmap(grid, SHM_SIZE) == -1)
+    if(munmap(board, shm_size) == -1)
         ERR("munmap");
     // Unlink the shared memory
     if(shm_unlink(shm_name) == -1)
@@ -11,6 +11,15 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <memory.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
 
 #define MAYBE_UNUSED(x) ((void)(x))
 #define ERR(source) \
@@ -18,22 +27,208 @@
 
 #define N_ITERATIONS 1000000
 #define LOG_LEN 8
+#define CHUNK_SAMPLES (1 << 20)
+#define MAX_CHUNKS UINT32_MAX
 
+/*
+ * Random number generation
+ */
 
-void child_work(int n, double* data, char* log){
-    int iteration_count = N_ITERATIONS;
+// Every worker draws from XOSHIRO_LANES interleaved xoshiro256** streams, so the vector kernels
+// can step them side by side while the scalar kernel produces exactly the same samples
+#define XOSHIRO_LANES 16
 
-    srand(getpid());
-    // Monte Carlo method
-    int count = 0;
-    double x, y;
-    for (int i = 0; i < iteration_count; i++) {
-        x = (double) rand() / RAND_MAX;
-        y = (double) rand() / RAND_MAX;
-        if (x * x + y * y <= 1) {
-            count++;
+typedef struct xoshiro {
+    _Alignas(64) uint64_t s[4][XOSHIRO_LANES];
+} xoshiro_t;
+
+// Word k of the splitmix64 sequence starting from seed, used to expand the master seed
+static uint64_t splitmix64(uint64_t seed, uint64_t k) {
+    uint64_t z = seed + (k + 1) * 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Worker n owns streams n * XOSHIRO_LANES onwards, each seeded with four fresh splitmix64 words
+void xoshiro_seed(xoshiro_t* rng, uint64_t seed, int n) {
+    for (int lane = 0; lane < XOSHIRO_LANES; lane++) {
+        uint64_t stream = (uint64_t) n * XOSHIRO_LANES + lane;
+        for (int k = 0; k < 4; k++)
+            rng->s[k][lane] = splitmix64(seed, stream * 4 + k);
+    }
+}
+
+static inline uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t xoshiro_next(xoshiro_t* rng, int lane) {
+    uint64_t* s0 = &rng->s[0][lane], * s1 = &rng->s[1][lane], * s2 = &rng->s[2][lane], * s3 = &rng->s[3][lane];
+    uint64_t result = rotl(*s1 * 5, 7) * 9;
+    uint64_t t = *s1 << 17;
+    *s2 ^= *s0;
+    *s3 ^= *s1;
+    *s1 ^= *s2;
+    *s0 ^= *s3;
+    *s2 ^= t;
+    *s3 = rotl(*s3, 45);
+    return result;
+}
+
+/*
+ * Sampling kernels
+ */
+
+// One 64-bit draw is one point: x and y are its two 31-bit halves and the point lies in the
+// quarter circle when x^2 + y^2 < 2^62, an exact integer test with no conversion to floating point
+static inline int in_circle(uint64_t r) {
+    uint64_t x = r >> 33, y = r & 0x7fffffff;
+    return x * x + y * y < (1ull << 62);
+}
+
+// Each kernel takes `rounds` steps of all lanes and returns the number of points inside
+typedef uint64_t (*kernel_t)(xoshiro_t* rng, uint64_t rounds);
+
+uint64_t kernel_scalar(xoshiro_t* rng, uint64_t rounds) {
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < rounds; i++)
+        for (int lane = 0; lane < XOSHIRO_LANES; lane++)
+            count += in_circle(xoshiro_next(rng, lane));
+    return count;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+#define AVX2_VECTORS (XOSHIRO_LANES / 4)
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_rotl(__m256i x, int k) {
+    return _mm256_or_si256(_mm256_slli_epi64(x, k), _mm256_srli_epi64(x, 64 - k));
+}
+
+__attribute__((target("avx2")))
+uint64_t kernel_avx2(xoshiro_t* rng, uint64_t rounds) {
+    __m256i s0[AVX2_VECTORS], s1[AVX2_VECTORS], s2[AVX2_VECTORS], s3[AVX2_VECTORS], count[AVX2_VECTORS];
+    const __m256i low = _mm256_set1_epi64x(0x7fffffff), zero = _mm256_setzero_si256();
+    for (int v = 0; v < AVX2_VECTORS; v++) {
+        s0[v] = _mm256_load_si256((__m256i*) &rng->s[0][v * 4]);
+        s1[v] = _mm256_load_si256((__m256i*) &rng->s[1][v * 4]);
+        s2[v] = _mm256_load_si256((__m256i*) &rng->s[2][v * 4]);
+        s3[v] = _mm256_load_si256((__m256i*) &rng->s[3][v * 4]);
+        count[v] = zero;
+    }
+    for (uint64_t i = 0; i < rounds; i++) {
+        for (int v = 0; v < AVX2_VECTORS; v++) {
+            // result = rotl(s1 * 5, 7) * 9, the multiplications done with shifts and adds
+            __m256i r = _mm256_add_epi64(_mm256_slli_epi64(s1[v], 2), s1[v]);
+            r = avx2_rotl(r, 7);
+            r = _mm256_add_epi64(_mm256_slli_epi64(r, 3), r);
+            __m256i t = _mm256_slli_epi64(s1[v], 17);
+            s2[v] = _mm256_xor_si256(s2[v], s0[v]);
+            s3[v] = _mm256_xor_si256(s3[v], s1[v]);
+            s1[v] = _mm256_xor_si256(s1[v], s2[v]);
+            s0[v] = _mm256_xor_si256(s0[v], s3[v]);
+            s2[v] = _mm256_xor_si256(s2[v], t);
+            s3[v] = avx2_rotl(s3[v], 45);
+
+            __m256i x = _mm256_srli_epi64(r, 33), y = _mm256_and_si256(r, low);
+            __m256i d = _mm256_add_epi64(_mm256_mul_epu32(x, x), _mm256_mul_epu32(y, y));
+            // Inside lanes compare to all ones, subtracting them counts the hits
+            count[v] = _mm256_sub_epi64(count[v], _mm256_cmpeq_epi64(_mm256_srli_epi64(d, 62), zero));
+        }
+    }
+    uint64_t total = 0;
+    for (int v = 0; v < AVX2_VECTORS; v++) {
+        _mm256_store_si256((__m256i*) &rng->s[0][v * 4], s0[v]);
+        _mm256_store_si256((__m256i*) &rng->s[1][v * 4], s1[v]);
+        _mm256_store_si256((__m256i*) &rng->s[2][v * 4], s2[v]);
+        _mm256_store_si256((__m256i*) &rng->s[3][v * 4], s3[v]);
+        _Alignas(32) uint64_t lanes[4];
+        _mm256_store_si256((__m256i*) lanes, count[v]);
+        total += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    return total;
+}
+
+#define AVX512_VECTORS (XOSHIRO_LANES / 8)
+
+__attribute__((target("avx512f")))
+uint64_t kernel_avx512(xoshiro_t* rng, uint64_t rounds) {
+    __m512i s0[AVX512_VECTORS], s1[AVX512_VECTORS], s2[AVX512_VECTORS], s3[AVX512_VECTORS];
+    const __m512i low = _mm512_set1_epi64(0x7fffffff), inside = _mm512_set1_epi64(1ll << 62);
+    for (int v = 0; v < AVX512_VECTORS; v++) {
+        s0[v] = _mm512_load_si512(&rng->s[0][v * 8]);
+        s1[v] = _mm512_load_si512(&rng->s[1][v * 8]);
+        s2[v] = _mm512_load_si512(&rng->s[2][v * 8]);
+        s3[v] = _mm512_load_si512(&rng->s[3][v * 8]);
+    }
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < rounds; i++) {
+        for (int v = 0; v < AVX512_VECTORS; v++) {
+            __m512i r = _mm512_add_epi64(_mm512_slli_epi64(s1[v], 2), s1[v]);
+            r = _mm512_rol_epi64(r, 7);
+            r = _mm512_add_epi64(_mm512_slli_epi64(r, 3), r);
+            __m512i t = _mm512_slli_epi64(s1[v], 17);
+            s2[v] = _mm512_xor_si512(s2[v], s0[v]);
+            s3[v] = _mm512_xor_si512(s3[v], s1[v]);
+            s1[v] = _mm512_xor_si512(s1[v], s2[v]);
+            s0[v] = _mm512_xor_si512(s0[v], s3[v]);
+            s2[v] = _mm512_xor_si512(s2[v], t);
+            s3[v] = _mm512_rol_epi64(s3[v], 45);
+
+            __m512i x = _mm512_srli_epi64(r, 33), y = _mm512_and_si512(r, low);
+            __m512i d = _mm512_add_epi64(_mm512_mul_epu32(x, x), _mm512_mul_epu32(y, y));
+            count += __builtin_popcount(_mm512_cmplt_epu64_mask(d, inside));
         }
     }
+    for (int v = 0; v < AVX512_VECTORS; v++) {
+        _mm512_store_si512(&rng->s[0][v * 8], s0[v]);
+        _mm512_store_si512(&rng->s[1][v * 8], s1[v]);
+        _mm512_store_si512(&rng->s[2][v * 8], s2[v]);
+        _mm512_store_si512(&rng->s[3][v * 8], s3[v]);
+    }
+    return count;
+}
+
+#endif
+
+// Picks the widest kernel the CPU supports, every kernel gives the same counts for the same seed
+kernel_t select_kernel(const char** name) {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        *name = "avx512";
+        return kernel_avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return kernel_avx2;
+    }
+#endif
+    *name = "scalar";
+    return kernel_scalar;
+}
+
+// Draws `samples` points, whole rounds go through the kernel and the rest through the first lanes
+uint64_t sample(kernel_t kernel, xoshiro_t* rng, uint64_t samples) {
+    uint64_t count = kernel(rng, samples / XOSHIRO_LANES);
+    for (int lane = 0; lane < (int) (samples % XOSHIRO_LANES); lane++)
+        count += in_circle(xoshiro_next(rng, lane));
+    return count;
+}
+
+/*
+ * Workers
+ */
+
+void child_work(int n, double* data, char* log, kernel_t kernel, uint64_t seed){
+    uint64_t iteration_count = N_ITERATIONS;
+
+    xoshiro_t rng;
+    xoshiro_seed(&rng, seed, n);
+    // Monte Carlo method
+    uint64_t count = sample(kernel, &rng, iteration_count);
     double pi = 4 * (double) count / iteration_count;
 
     // Write the result to the shared memory
@@ -45,6 +240,166 @@ void child_work(int n, double* data, char* log){
     memcpy(log + n * LOG_LEN, log_entry, LOG_LEN);
 }
 
+/*
+ * Threaded mode
+ */
+
+// A worker's chunks are the index range [begin, end) packed into one word, the owner pops from the
+// front and thieves split off the back half, both with a single compare and swap
+#define RANGE(begin, end) (((uint64_t) (end) << 32) | (uint32_t) (begin))
+#define RANGE_BEGIN(range) ((uint32_t) (range))
+#define RANGE_END(range) ((uint32_t) ((range) >> 32))
+
+typedef struct worker {
+    _Alignas(64) uint64_t range;
+    // Only written by the worker and read after it is joined
+    uint64_t count;
+    uint64_t samples;
+    uint64_t stolen;
+} worker_t;
+
+typedef struct pool {
+    int n;
+    worker_t* workers;
+    uint64_t total;
+    uint64_t chunk;
+    uint32_t chunks;
+    uint64_t seed;
+    kernel_t kernel;
+} pool_t;
+
+typedef struct worker_args {
+    pthread_t tid;
+    pool_t* pool;
+    int n;
+    int cpu;
+} worker_args_t;
+
+// Takes the next chunk of the worker's own range
+int pop_chunk(worker_t* worker, uint32_t* chunk) {
+    uint64_t range = __atomic_load_n(&worker->range, __ATOMIC_ACQUIRE);
+    while (RANGE_BEGIN(range) < RANGE_END(range)) {
+        if (__atomic_compare_exchange_n(&worker->range, &range, RANGE(RANGE_BEGIN(range) + 1, RANGE_END(range)), 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *chunk = RANGE_BEGIN(range);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Moves the back half of the fullest other range into the thief's own, which is empty
+int steal_chunks(pool_t* pool, int thief) {
+    for (;;) {
+        int victim = -1;
+        uint64_t range, most = 0;
+        for (int i = 0; i < pool->n; i++) {
+            uint64_t candidate = __atomic_load_n(&pool->workers[i].range, __ATOMIC_ACQUIRE);
+            if (i != thief && RANGE_END(candidate) - RANGE_BEGIN(candidate) > most && RANGE_BEGIN(candidate) < RANGE_END(candidate)) {
+                most = RANGE_END(candidate) - RANGE_BEGIN(candidate);
+                victim = i;
+                range = candidate;
+            }
+        }
+        if (victim == -1)
+            return 0;
+        uint32_t begin = RANGE_BEGIN(range), end = RANGE_END(range), split = end - (end - begin + 1) / 2;
+        if (!__atomic_compare_exchange_n(&pool->workers[victim].range, &range, RANGE(begin, split), 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            continue;
+        pool->workers[thief].stolen += end - split;
+        __atomic_store_n(&pool->workers[thief].range, RANGE(split, end), __ATOMIC_RELEASE);
+        return 1;
+    }
+}
+
+void pin_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (error)
+        errno = error, ERR("pthread_setaffinity_np");
+}
+
+void* thread_work(void* void_args) {
+    worker_args_t* args = void_args;
+    pool_t* pool = args->pool;
+    worker_t* worker = &pool->workers[args->n];
+    if (args->cpu >= 0)
+        pin_thread(args->cpu);
+
+    // Chunk i always draws from stream i, so the estimate does not depend on who ran which chunk
+    xoshiro_t rng;
+    uint32_t chunk;
+    uint64_t count = 0, samples = 0;
+    while (pop_chunk(worker, &chunk) || (steal_chunks(pool, args->n) && pop_chunk(worker, &chunk))) {
+        uint64_t first = (uint64_t) chunk * pool->chunk;
+        uint64_t length = pool->total - first < pool->chunk ? pool->total - first : pool->chunk;
+        xoshiro_seed(&rng, pool->seed, (int) chunk);
+        count += sample(pool->kernel, &rng, length);
+        samples += length;
+    }
+    worker->count = count;
+    worker->samples = samples;
+    return NULL;
+}
+
+// Runs the sample budget on n pinned threads and reduces their counts once they are joined
+void threads_work(int n, double* data, char* log, kernel_t kernel, uint64_t seed, uint64_t total, uint64_t chunk) {
+    pool_t pool = {.n = n, .total = total, .chunk = chunk, .seed = seed, .kernel = kernel};
+    if ((total + chunk - 1) / chunk > MAX_CHUNKS)
+        ERR("Too many chunks, use larger ones");
+    pool.chunks = (total + chunk - 1) / chunk;
+    if ((pool.workers = aligned_alloc(_Alignof(worker_t), n * sizeof(worker_t))) == NULL)
+        ERR("aligned_alloc");
+    worker_args_t* args;
+    if ((args = calloc(n, sizeof(worker_args_t))) == NULL)
+        ERR("calloc");
+
+    // Workers start with equal shares of the chunks and go round the CPUs the process may use
+    cpu_set_t allowed;
+    int cpus = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+        ERR("sched_getaffinity");
+    int cpu_list[CPU_SETSIZE];
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &allowed))
+            cpu_list[cpus++] = cpu;
+    for (int i = 0; i < n; i++) {
+        memset(&pool.workers[i], 0, sizeof(worker_t));
+        pool.workers[i].range = RANGE((uint64_t) pool.chunks * i / n, (uint64_t) pool.chunks * (i + 1) / n);
+        args[i] = (worker_args_t){.pool = &pool, .n = i, .cpu = cpus ? cpu_list[i % cpus] : -1};
+    }
+    for (int i = 0; i < n; i++) {
+        int error = pthread_create(&args[i].tid, NULL, thread_work, &args[i]);
+        if (error)
+            errno = error, ERR("pthread_create");
+    }
+
+    uint64_t count = 0, samples = 0, stolen = 0;
+    for (int i = 0; i < n; i++) {
+        int error = pthread_join(args[i].tid, NULL);
+        if (error)
+            errno = error, ERR("pthread_join");
+        worker_t* worker = &pool.workers[i];
+        count += worker->count;
+        samples += worker->samples;
+        stolen += worker->stolen;
+
+        data[i] = worker->samples ? 4 * (double) worker->count / worker->samples : 0;
+        char log_entry[LOG_LEN + 1];
+        snprintf(log_entry, LOG_LEN + 1, "%7.5f\n", data[i]);
+        memcpy(log + i * LOG_LEN, log_entry, LOG_LEN);
+    }
+
+    printf("%u chunks of %llu samples, %llu stolen\n", pool.chunks, (unsigned long long) chunk, (unsigned long long) stolen);
+    printf("Pi is approximately %f\n", 4 * (double) count / samples);
+
+    free(args);
+    free(pool.workers);
+}
+
 void parent_work(int n, double* data)
 {
     // Wait for all children to finish
@@ -69,14 +424,14 @@ void parent_work(int n, double* data)
     printf("Pi is approximately %f\n", sum);
 }
 
-void create_children(int n, double* data, char* log)
+void create_children(int n, double* data, char* log, kernel_t kernel, uint64_t seed)
 {
     while (n-- > 0)
     {
         switch (fork())
         {
             case 0:
-                child_work(n, data, log);
+                child_work(n, data, log, kernel, seed);
                 exit(EXIT_SUCCESS);
             case -1:
                 perror("Fork:");
@@ -87,11 +442,40 @@ void create_children(int n, double* data, char* log)
 
 int main(int argc, char *argv[]) {
     // Input validation
-    if(argc != 2)
-        ERR("Usage: ./monte-carlo-pi <number-of-children>");
-    int n = atoi(argv[1]);
+    int threads = 0, opt;
+    uint64_t total = 0, chunk = CHUNK_SAMPLES;
+    while((opt = getopt(argc, argv, "ts:c:")) != -1) {
+        switch(opt) {
+            case 't':
+                threads = 1;
+                break;
+            case 's':
+                if((total = strtoull(optarg, NULL, 0)) == 0)
+                    ERR("Invalid number of samples");
+                break;
+            case 'c':
+                if((chunk = strtoull(optarg, NULL, 0)) == 0)
+                    ERR("Invalid chunk size");
+                break;
+            default:
+                ERR("Usage: ./monte-carlo-pi [-t] [-s samples] [-c chunk] <number-of-workers> [seed]");
+        }
+    }
+    if((argc - optind != 1 && argc - optind != 2) || (!threads && (total != 0 || chunk != CHUNK_SAMPLES)))
+        ERR("Usage: ./monte-carlo-pi [-t] [-s samples] [-c chunk] <number-of-workers> [seed]");
+    int n = atoi(argv[optind]);
     if(n <= 0)
         ERR("Invalid number of children");
+    // The master seed makes a run reproducible, without one it is picked from the clock
+    uint64_t seed = argc - optind == 2 ? strtoull(argv[optind + 1], NULL, 0) : (uint64_t) time(NULL) ^ ((uint64_t) getpid() << 32);
+    // The threaded mode shares out the same budget as the children get by default
+    if(total == 0)
+        total = (uint64_t) n * N_ITERATIONS;
+
+    const char* kernel_name;
+    kernel_t kernel = select_kernel(&kernel_name);
+    printf("Seed %llu, %s kernel\n", (unsigned long long) seed, kernel_name);
+    fflush(stdout);
 
     /*
      * Create shared memory
@@ -119,8 +503,12 @@ int main(int argc, char *argv[]) {
     if((data = mmap(NULL, n * sizeof(double), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
         ERR("mmap");
 
-    create_children(n, data, log);
-    parent_work(n, data);
+    if(threads)
+        threads_work(n, data, log, kernel, seed, total, chunk);
+    else {
+        create_children(n, data, log, kernel, seed);
+        parent_work(n, data);
+    }
 
     // Cleanup
 
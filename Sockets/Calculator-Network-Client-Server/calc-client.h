@@ -0,0 +1,853 @@
+//
+// Asynchronous client library for the calculator server.
+//
+// A client keeps a pool of persistent connections (TCP or local) to the server. Any thread may submit requests;
+// every request gets a correlation id and completes through a callback or a future. Requests are pipelined:
+// the submitting thread appends the frame to a connection (round robin) and writes it right away if the socket
+// accepts it, while a single I/O thread reads the replies and sends whatever the sockets did not accept yet.
+// The server answers the requests of a connection in order, so every connection matches its replies against
+// a FIFO of the requests it sent. Connections negotiate the compact protocol version 2 right after connecting and
+// stay at version 1 with servers that do not know it; the 64-bit results of version 2 are wrapped to 32 bits, which
+// gives the same results as the 32-bit arithmetic of version 1.
+//
+// The I/O thread connects and negotiates without blocking, so a server that is down or restarting never stops the
+// caller: requests of a broken connection complete with CALC_CLIENT_DISCONNECTED and the connection is opened again
+// with an exponential backoff, while requests go to the connections that are still up.
+//
+// Fire-and-forget callers may use the datagram functions instead (calc_datagram_open, calc_datagram_call),
+// which keep no connection state: one request per datagram, retried until a matching reply arrives.
+//
+// Callers on the same host may map shared-memory rings instead (calc_shm_connect), negotiated over the local
+// socket; requests and replies then cost no system call while both sides keep up.
+//
+
+#ifndef SOCKETS_CALC_CLIENT_H
+#define SOCKETS_CALC_CLIENT_H
+
+#include "socklib.h"
+#include "macros.h"
+#include "shm-ring.h"
+#include "protocol.h"
+#include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#define CALC_CLIENT_DISCONNECTED (-2) // Status of the requests lost with a broken connection
+#define CALC_CLIENT_FRAME_SIZE sizeof(int32_t[MESSAGE_SIZE])
+#define CALC_CLIENT_MAX_EVENTS 64
+#define CALC_CLIENT_RETRY_MS 10       // First delay before connecting again after a failure
+#define CALC_CLIENT_RETRY_MAX_MS 1000 // The delay doubles after every failure up to this
+#define CALC_CLIENT_TIMEOUT (-3)      // Status of a datagram request that got no reply
+#define CALC_DATAGRAM_TIMEOUT_MS 200  // Time waited for the reply to one datagram
+#define CALC_DATAGRAM_ATTEMPTS 5
+#define CALC_SHM_SPIN 20000 // Polls of the reply ring before sleeping on the eventfd
+
+/// @brief Completion callback, called from the I/O thread of the client
+/// @param arg Argument given at submission
+/// @param id Correlation id of the request
+/// @param result Result of the operation
+/// @param status 0 on success, -1 if the server rejected the operation, CALC_CLIENT_DISCONNECTED
+typedef void (*calc_callback_t)(void *arg, uint64_t id, int32_t result, int32_t status);
+
+typedef struct
+{
+    uint64_t id;
+    calc_callback_t callback;
+    void *arg;
+    // Kept to encode the request once the connection is up, when it was submitted before
+    int32_t operand1, operand2;
+    char operation;
+} calc_pending_t;
+
+typedef enum
+{
+    CALC_CONNECTION_DOWN,        // No socket, the I/O thread connects again at retry_at
+    CALC_CONNECTION_CONNECTING,  // Non-blocking connect in progress
+    CALC_CONNECTION_NEGOTIATING, // Waiting for the reply to the protocol version request
+    CALC_CONNECTION_UP,
+} calc_connection_state_t;
+
+typedef struct
+{
+    pthread_mutex_t mutex;
+    int fd;
+    calc_connection_state_t state;
+    int version; // Protocol version agreed on with the server
+
+    // Requests sent (or queued in out) and not answered yet, oldest first; until the connection is up they are
+    // only queued here and encoded once the version is known
+    calc_pending_t *pending;
+    size_t pending_head, pending_count, pending_capacity;
+
+    // Frames the socket did not accept yet
+    char *out;
+    size_t out_length, out_capacity;
+    int want_write; // Whether the I/O thread should watch for EPOLLOUT
+
+    // Partial reply, touched only by the I/O thread, like the reconnection schedule
+    char in[CALC_CLIENT_FRAME_SIZE];
+    size_t in_length;
+    uint64_t retry_at;
+    int backoff_ms;
+} calc_connection_t;
+
+typedef struct
+{
+    char *address, *port; // port is NULL for a local socket
+    struct sockaddr_in tcp_address;
+    struct sockaddr_un local_address;
+    int n_connections;
+    calc_connection_t *connections;
+    uint64_t next_id;
+    unsigned next_connection;
+
+    int epoll_fd;
+    int wake_fd; // Tells the I/O thread that a connection needs EPOLLOUT or that the client is closing
+    int stop;
+    pthread_t io_thread;
+} calc_client_t;
+
+/// @brief Future completed by calc_future_callback
+typedef struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int done;
+    int32_t result, status;
+} calc_future_t;
+
+/// @brief Monotonic time in milliseconds
+uint64_t calc_client_clock_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/// @brief Encode a request in the protocol version of the connection
+/// @param buffer Output, at least CALC_CLIENT_FRAME_SIZE bytes
+/// @return Size of the request
+size_t calc_encode_request(int version, char *buffer, int32_t operand1, int32_t operand2, char operation)
+{
+    if (PROTOCOL_V2 == version)
+        return v2_encode_request((uint8_t *)buffer, operation, operand1, operand2);
+    int32_t data[MESSAGE_SIZE];
+    data[OPERAND1_INDEX] = htonl(operand1);
+    data[OPERAND2_INDEX] = htonl(operand2);
+    data[RESULT_INDEX] = 0;
+    data[OPERATION_INDEX] = htonl(operation);
+    data[STATUS_INDEX] = 0;
+    memcpy(buffer, data, sizeof(data));
+    return sizeof(data);
+}
+
+/// @brief Append bytes to the frames the socket did not accept yet, growing the buffer (connection mutex held)
+void calc_connection_queue(calc_connection_t *connection, const char *data, size_t size)
+{
+    while (connection->out_length + size > connection->out_capacity)
+    {
+        connection->out_capacity *= 2;
+        if (NULL == (connection->out = realloc(connection->out, connection->out_capacity)))
+            ERR("realloc");
+    }
+    memcpy(connection->out + connection->out_length, data, size);
+    connection->out_length += size;
+}
+
+/// @brief Write the queued frames of a connection without blocking (connection mutex held)
+/// @return 0 on success (some frames may be left), -1 if the connection is broken
+int calc_connection_flush(calc_connection_t *connection)
+{
+    size_t written = 0;
+    while (written < connection->out_length)
+    {
+        ssize_t c = TEMP_FAILURE_RETRY(write(connection->fd, connection->out + written, connection->out_length - written));
+        if (c < 0)
+        {
+            if (EAGAIN == errno || EWOULDBLOCK == errno)
+                break;
+            return -1;
+        }
+        written += c;
+    }
+    connection->out_length -= written;
+    memmove(connection->out, connection->out + written, connection->out_length);
+    return 0;
+}
+
+/// @brief Register the connection socket in the epoll instance of the I/O thread (connection mutex held)
+void calc_connection_watch(calc_client_t *client, int index, int op)
+{
+    calc_connection_t *connection = &client->connections[index];
+    // A non-blocking connect completes when the socket becomes writable
+    int want_write = connection->out_length > 0 || CALC_CONNECTION_CONNECTING == connection->state;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+    ev.data.u32 = index;
+    if (epoll_ctl(client->epoll_fd, op, connection->fd, &ev) < 0)
+        ERR("epoll_ctl");
+    connection->want_write = want_write;
+}
+
+/// @brief Move every pending request of a connection out of it (connection mutex held)
+/// @param lost Set to the requests, to be passed to calc_pending_fail once the mutex is released
+/// @return Number of requests
+size_t calc_connection_take_pending(calc_connection_t *connection, calc_pending_t **lost)
+{
+    size_t count = connection->pending_count, head = connection->pending_head;
+    if (NULL == (*lost = malloc((count ? count : 1) * sizeof(calc_pending_t))))
+        ERR("malloc");
+    for (size_t i = 0; i < count; i++)
+        (*lost)[i] = connection->pending[(head + i) % connection->pending_capacity];
+    connection->pending_head = connection->pending_count = 0;
+    return count;
+}
+
+/// @brief Complete requests taken from a connection with CALC_CLIENT_DISCONNECTED, no connection mutex held
+void calc_pending_fail(calc_pending_t *lost, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        lost[i].callback(lost[i].arg, lost[i].id, 0, CALC_CLIENT_DISCONNECTED);
+    free(lost);
+}
+
+/// @brief Close the socket of a connection and schedule the next attempt to connect (connection mutex held)
+/// @return Number of requests lost with the connection, see calc_connection_take_pending
+size_t calc_connection_down(calc_connection_t *connection, calc_pending_t **lost)
+{
+    // Closing the socket also removes it from the epoll instance
+    if (connection->fd >= 0 && TEMP_FAILURE_RETRY(close(connection->fd)) < 0)
+        ERR("close");
+    connection->fd = -1;
+    connection->state = CALC_CONNECTION_DOWN;
+    connection->out_length = 0;
+    connection->in_length = 0;
+    connection->want_write = 0;
+    connection->retry_at = calc_client_clock_ms() + connection->backoff_ms;
+    connection->backoff_ms = connection->backoff_ms * 2 < CALC_CLIENT_RETRY_MAX_MS ? connection->backoff_ms * 2
+                                                                                  : CALC_CLIENT_RETRY_MAX_MS;
+    return calc_connection_take_pending(connection, lost);
+}
+
+/// @brief Ask the server for protocol version 2 on a connected socket, the reply is read by the I/O thread
+/// (connection mutex held)
+/// @return 0 on success, -1 if the connection is broken
+int calc_connection_negotiate(calc_connection_t *connection)
+{
+    int32_t frame[MESSAGE_SIZE] = {0};
+    frame[OPERAND1_INDEX] = htonl(PROTOCOL_V2);
+    frame[OPERATION_INDEX] = htonl(OPERATION_VERSION);
+    calc_connection_queue(connection, (char *)frame, sizeof(frame));
+    connection->state = CALC_CONNECTION_NEGOTIATING;
+    return calc_connection_flush(connection);
+}
+
+/// @brief Start connecting a connection that is down, without blocking (connection mutex held)
+/// @return 0 if the connection is on its way up, -1 if it failed already
+int calc_connection_open(calc_client_t *client, int index)
+{
+    calc_connection_t *connection = &client->connections[index];
+    int fd = socket(client->port ? PF_INET : PF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    connection->fd = fd;
+    int c = client->port ? connect(fd, (struct sockaddr *)&client->tcp_address, sizeof(client->tcp_address))
+                         : connect(fd, (struct sockaddr *)&client->local_address, SUN_LEN(&client->local_address));
+    if (c < 0 && EINPROGRESS != errno)
+        return -1;
+    connection->state = CALC_CONNECTION_CONNECTING;
+    // Local sockets usually connect at once
+    if (0 == c && calc_connection_negotiate(connection) < 0)
+        return -1;
+    calc_connection_watch(client, index, EPOLL_CTL_ADD);
+    return 0;
+}
+
+/// @brief Finish a non-blocking connect once the socket became writable (connection mutex held)
+/// @return 0 on success, -1 if the connection failed
+int calc_connection_connected(calc_client_t *client, int index)
+{
+    calc_connection_t *connection = &client->connections[index];
+    int error;
+    socklen_t length = sizeof(error);
+    if (getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error)
+        return -1;
+    if (calc_connection_negotiate(connection) < 0)
+        return -1;
+    calc_connection_watch(client, index, EPOLL_CTL_MOD);
+    return 0;
+}
+
+/// @brief Take the reply to the version request and send the requests submitted in the meantime
+/// (connection mutex held)
+/// @return 0 on success, -1 if the connection is broken
+int calc_connection_up(calc_client_t *client, int index)
+{
+    calc_connection_t *connection = &client->connections[index];
+    int32_t frame[MESSAGE_SIZE];
+    memcpy(frame, connection->in, sizeof(frame));
+    connection->version = 0 == frame[STATUS_INDEX] && PROTOCOL_V2 == (int)ntohl(frame[RESULT_INDEX]) ? PROTOCOL_V2
+                                                                                                      : PROTOCOL_V1;
+    connection->state = CALC_CONNECTION_UP;
+    connection->backoff_ms = CALC_CLIENT_RETRY_MS;
+    for (size_t i = 0; i < connection->pending_count; i++)
+    {
+        calc_pending_t *pending = &connection->pending[(connection->pending_head + i) % connection->pending_capacity];
+        char data[CALC_CLIENT_FRAME_SIZE];
+        size_t size = calc_encode_request(connection->version, data, pending->operand1, pending->operand2,
+                                          pending->operation);
+        calc_connection_queue(connection, data, size);
+    }
+    if (calc_connection_flush(connection) < 0)
+        return -1;
+    calc_connection_watch(client, index, EPOLL_CTL_MOD);
+    return 0;
+}
+
+/// @brief Read the available replies of a connection and complete their requests
+/// @return 0 on success, -1 if the connection is broken
+int calc_connection_read(calc_client_t *client, int index)
+{
+    calc_connection_t *connection = &client->connections[index];
+    char buffer[64 * CALC_CLIENT_FRAME_SIZE];
+    ssize_t c = TEMP_FAILURE_RETRY(read(connection->fd, buffer, sizeof(buffer)));
+    if (c < 0)
+        return EAGAIN == errno || EWOULDBLOCK == errno ? 0 : -1;
+    if (0 == c)
+        return -1;
+
+    for (ssize_t i = 0; i < c; i++)
+    {
+        int32_t status;
+        int64_t result;
+        connection->in[connection->in_length++] = buffer[i];
+        if (CALC_CONNECTION_NEGOTIATING == connection->state)
+        {
+            // The state only changes on the I/O thread, the mutex keeps submitters off the half-built queue
+            if (connection->in_length < CALC_CLIENT_FRAME_SIZE)
+                continue;
+            pthread_mutex_lock(&connection->mutex);
+            int up = calc_connection_up(client, index);
+            pthread_mutex_unlock(&connection->mutex);
+            if (up < 0)
+                return -1;
+            connection->in_length = 0;
+            continue;
+        }
+        if (PROTOCOL_V2 == connection->version)
+        {
+            int size = v2_decode_reply((uint8_t *)connection->in, connection->in_length, &status, &result);
+            if (size < 0)
+                return -1;
+            if (0 == size)
+                continue;
+        }
+        else
+        {
+            if (connection->in_length < CALC_CLIENT_FRAME_SIZE)
+                continue;
+            int32_t data[MESSAGE_SIZE];
+            memcpy(data, connection->in, sizeof(data));
+            status = ntohl(data[STATUS_INDEX]);
+            result = (int32_t)ntohl(data[RESULT_INDEX]);
+        }
+        connection->in_length = 0;
+
+        pthread_mutex_lock(&connection->mutex);
+        if (0 == connection->pending_count)
+        {
+            pthread_mutex_unlock(&connection->mutex);
+            return -1; // The server answered something we did not ask for
+        }
+        calc_pending_t pending = connection->pending[connection->pending_head];
+        connection->pending_head = (connection->pending_head + 1) % connection->pending_capacity;
+        connection->pending_count--;
+        pthread_mutex_unlock(&connection->mutex);
+
+        // Callbacks run without any lock held, so they may submit new requests
+        pending.callback(pending.arg, pending.id, (int32_t)result, status);
+    }
+    return 0;
+}
+
+/// @brief Give up on a broken connection, failing its requests; the I/O thread connects again later
+void calc_connection_reset(calc_client_t *client, int index)
+{
+    calc_connection_t *connection = &client->connections[index];
+    calc_pending_t *lost;
+    pthread_mutex_lock(&connection->mutex);
+    size_t count = calc_connection_down(connection, &lost);
+    pthread_mutex_unlock(&connection->mutex);
+    calc_pending_fail(lost, count);
+}
+
+/// @brief Connect again the connections whose retry delay has passed
+/// @return Milliseconds until the next attempt, -1 if every connection is up or on its way
+int calc_client_retry(calc_client_t *client)
+{
+    int timeout = -1;
+    uint64_t now = calc_client_clock_ms();
+    for (int i = 0; i < client->n_connections; i++)
+    {
+        calc_connection_t *connection = &client->connections[i];
+        if (CALC_CONNECTION_DOWN != connection->state)
+            continue;
+        if (connection->retry_at > now)
+        {
+            int wait = (int)(connection->retry_at - now);
+            timeout = timeout < 0 || wait < timeout ? wait : timeout;
+            continue;
+        }
+        calc_pending_t *lost = NULL;
+        size_t count = 0;
+        pthread_mutex_lock(&connection->mutex);
+        if (calc_connection_open(client, i) < 0)
+        {
+            count = calc_connection_down(connection, &lost);
+            timeout = timeout < 0 || connection->backoff_ms < timeout ? connection->backoff_ms : timeout;
+        }
+        pthread_mutex_unlock(&connection->mutex);
+        if (lost)
+            calc_pending_fail(lost, count);
+    }
+    return timeout;
+}
+
+void *calc_client_io_work(void *args)
+{
+    calc_client_t *client = args;
+    struct epoll_event events[CALC_CLIENT_MAX_EVENTS];
+    while (!__atomic_load_n(&client->stop, __ATOMIC_ACQUIRE))
+    {
+        int timeout = calc_client_retry(client);
+        int nfds = TEMP_FAILURE_RETRY(epoll_wait(client->epoll_fd, events, CALC_CLIENT_MAX_EVENTS, timeout));
+        if (nfds < 0)
+            ERR("epoll_wait");
+        for (int i = 0; i < nfds; i++)
+        {
+            if (UINT32_MAX == events[i].data.u32)
+            {
+                // Some submitters left frames behind, watch their connections for EPOLLOUT; requests submitted
+                // while every connection was down fail right away instead of waiting for the next attempt
+                uint64_t count;
+                if (TEMP_FAILURE_RETRY(read(client->wake_fd, &count, sizeof(count))) < 0 && EAGAIN != errno)
+                    ERR("read");
+                for (int j = 0; j < client->n_connections; j++)
+                {
+                    calc_connection_t *connection = &client->connections[j];
+                    calc_pending_t *lost = NULL;
+                    size_t lost_count = 0;
+                    pthread_mutex_lock(&connection->mutex);
+                    if (CALC_CONNECTION_DOWN == connection->state && connection->pending_count > 0)
+                        lost_count = calc_connection_take_pending(connection, &lost);
+                    else if (CALC_CONNECTION_UP == connection->state && connection->out_length > 0 &&
+                             !connection->want_write)
+                        calc_connection_watch(client, j, EPOLL_CTL_MOD);
+                    pthread_mutex_unlock(&connection->mutex);
+                    if (lost)
+                        calc_pending_fail(lost, lost_count);
+                }
+                continue;
+            }
+
+            int index = events[i].data.u32;
+            calc_connection_t *connection = &client->connections[index];
+            // The connection was reset by an earlier event of the same batch
+            if (CALC_CONNECTION_DOWN == connection->state)
+                continue;
+            int broken = 0;
+            if (CALC_CONNECTION_CONNECTING == connection->state)
+            {
+                pthread_mutex_lock(&connection->mutex);
+                broken = calc_connection_connected(client, index) < 0;
+                pthread_mutex_unlock(&connection->mutex);
+                if (broken)
+                    calc_connection_reset(client, index);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT)
+            {
+                pthread_mutex_lock(&connection->mutex);
+                broken = calc_connection_flush(connection) < 0;
+                if (!broken && 0 == connection->out_length)
+                    calc_connection_watch(client, index, EPOLL_CTL_MOD);
+                pthread_mutex_unlock(&connection->mutex);
+            }
+            if (!broken && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                broken = calc_connection_read(client, index) < 0;
+            if (broken)
+                calc_connection_reset(client, index);
+        }
+    }
+    return NULL;
+}
+
+/// @brief Create a client of the server, its connections come up in the background
+/// @param address Server address, or name of the local socket
+/// @param port Server port, NULL to use the local socket
+/// @param n_connections Number of persistent connections
+/// @return Client
+calc_client_t *calc_client_create(char *address, char *port, int n_connections)
+{
+    calc_client_t *client = calloc(1, sizeof(calc_client_t));
+    if (NULL == client)
+        ERR("calloc");
+    client->address = address;
+    client->port = port;
+    if (port)
+        client->tcp_address = make_address(address, port);
+    else
+    {
+        client->local_address.sun_family = AF_UNIX;
+        strncpy(client->local_address.sun_path, address, sizeof(client->local_address.sun_path) - 1);
+    }
+    client->n_connections = n_connections;
+    if (NULL == (client->connections = calloc(n_connections, sizeof(calc_connection_t))))
+        ERR("calloc");
+    if ((client->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        ERR("epoll_create1");
+    if ((client->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        ERR("eventfd");
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = UINT32_MAX;
+    if (epoll_ctl(client->epoll_fd, EPOLL_CTL_ADD, client->wake_fd, &ev) < 0)
+        ERR("epoll_ctl");
+
+    // Every connection starts down and due, the I/O thread connects them without blocking
+    uint64_t now = calc_client_clock_ms();
+    for (int i = 0; i < n_connections; i++)
+    {
+        calc_connection_t *connection = &client->connections[i];
+        if (pthread_mutex_init(&connection->mutex, NULL))
+            ERR("pthread_mutex_init");
+        connection->fd = -1;
+        connection->state = CALC_CONNECTION_DOWN;
+        connection->retry_at = now;
+        connection->backoff_ms = CALC_CLIENT_RETRY_MS;
+        connection->pending_capacity = 64;
+        connection->out_capacity = 64 * CALC_CLIENT_FRAME_SIZE;
+        connection->pending = malloc(connection->pending_capacity * sizeof(calc_pending_t));
+        connection->out = malloc(connection->out_capacity);
+        if (NULL == connection->pending || NULL == connection->out)
+            ERR("malloc");
+    }
+
+    if (pthread_create(&client->io_thread, NULL, calc_client_io_work, client))
+        ERR("pthread_create");
+    return client;
+}
+
+/// @brief Submit a request
+/// @param client Client
+/// @param operand1 First operand
+/// @param operand2 Second operand
+/// @param operation One of '+', '-', '*', '/'
+/// @param callback Called from the I/O thread once the reply arrives, with CALC_CLIENT_DISCONNECTED if the
+/// connection broke or every connection was down
+/// @param arg Argument of the callback
+/// @return Correlation id of the request
+uint64_t calc_client_submit(calc_client_t *client, int32_t operand1, int32_t operand2, char operation,
+                            calc_callback_t callback, void *arg)
+{
+    uint64_t id = __atomic_fetch_add(&client->next_id, 1, __ATOMIC_RELAXED);
+
+    // Round robin over the connections that are not down, the last one is kept when all of them are
+    calc_connection_t *connection = NULL;
+    for (int attempt = 0; attempt < client->n_connections; attempt++)
+    {
+        if (connection)
+            pthread_mutex_unlock(&connection->mutex);
+        int index = __atomic_fetch_add(&client->next_connection, 1, __ATOMIC_RELAXED) % client->n_connections;
+        connection = &client->connections[index];
+        pthread_mutex_lock(&connection->mutex);
+        if (CALC_CONNECTION_DOWN != connection->state)
+            break;
+    }
+
+    // Grow the FIFO of pending requests (unwrapping it) when it is full
+    if (connection->pending_count == connection->pending_capacity)
+    {
+        calc_pending_t *pending = malloc(2 * connection->pending_capacity * sizeof(calc_pending_t));
+        if (NULL == pending)
+            ERR("malloc");
+        for (size_t i = 0; i < connection->pending_count; i++)
+            pending[i] = connection->pending[(connection->pending_head + i) % connection->pending_capacity];
+        free(connection->pending);
+        connection->pending = pending;
+        connection->pending_head = 0;
+        connection->pending_capacity *= 2;
+    }
+
+    calc_pending_t *pending = &connection->pending[(connection->pending_head + connection->pending_count++) %
+                                                   connection->pending_capacity];
+    pending->id = id;
+    pending->callback = callback;
+    pending->arg = arg;
+    pending->operand1 = operand1;
+    pending->operand2 = operand2;
+    pending->operation = operation;
+
+    // Send right away once the connection is up, leave the rest (or a broken connection) to the I/O thread;
+    // the version is only known then, so the request is encoded under the mutex
+    int wake = CALC_CONNECTION_DOWN == connection->state;
+    if (CALC_CONNECTION_UP == connection->state)
+    {
+        char data[CALC_CLIENT_FRAME_SIZE];
+        size_t size = calc_encode_request(connection->version, data, operand1, operand2, operation);
+        calc_connection_queue(connection, data, size);
+        if (!connection->want_write)
+            wake = calc_connection_flush(connection) < 0 || connection->out_length > 0;
+    }
+    pthread_mutex_unlock(&connection->mutex);
+
+    if (wake)
+    {
+        uint64_t one = 1;
+        if (TEMP_FAILURE_RETRY(write(client->wake_fd, &one, sizeof(one))) < 0)
+            ERR("write");
+    }
+    return id;
+}
+
+void calc_future_init(calc_future_t *future)
+{
+    if (pthread_mutex_init(&future->mutex, NULL) || pthread_cond_init(&future->cond, NULL))
+        ERR("pthread_init");
+    future->done = 0;
+}
+
+void calc_future_destroy(calc_future_t *future)
+{
+    pthread_mutex_destroy(&future->mutex);
+    pthread_cond_destroy(&future->cond);
+}
+
+/// @brief Callback completing the future passed as its argument
+void calc_future_callback(void *arg, uint64_t id, int32_t result, int32_t status)
+{
+    (void)id;
+    calc_future_t *future = arg;
+    pthread_mutex_lock(&future->mutex);
+    future->result = result;
+    future->status = status;
+    future->done = 1;
+    pthread_cond_signal(&future->cond);
+    pthread_mutex_unlock(&future->mutex);
+}
+
+/// @brief Wait until the future completes
+/// @param future Future
+/// @param result Set to the result of the operation
+/// @return Status of the request (0 on success)
+int32_t calc_future_wait(calc_future_t *future, int32_t *result)
+{
+    pthread_mutex_lock(&future->mutex);
+    while (!future->done)
+        pthread_cond_wait(&future->cond, &future->mutex);
+    pthread_mutex_unlock(&future->mutex);
+    *result = future->result;
+    return future->status;
+}
+
+/// @brief Submit a request and wait for its reply
+/// @return Status of the request (0 on success)
+int32_t calc_client_call(calc_client_t *client, int32_t operand1, int32_t operand2, char operation, int32_t *result)
+{
+    calc_future_t future;
+    calc_future_init(&future);
+    calc_client_submit(client, operand1, operand2, operation, calc_future_callback, &future);
+    int32_t status = calc_future_wait(&future, result);
+    calc_future_destroy(&future);
+    return status;
+}
+
+/// @brief Stop the I/O thread and close the connections, requests still pending are not completed
+void calc_client_destroy(calc_client_t *client)
+{
+    __atomic_store_n(&client->stop, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (TEMP_FAILURE_RETRY(write(client->wake_fd, &one, sizeof(one))) < 0)
+        ERR("write");
+    if (pthread_join(client->io_thread, NULL))
+        ERR("pthread_join");
+    for (int i = 0; i < client->n_connections; i++)
+    {
+        if (client->connections[i].fd >= 0 && TEMP_FAILURE_RETRY(close(client->connections[i].fd)) < 0)
+            ERR("close");
+        pthread_mutex_destroy(&client->connections[i].mutex);
+        free(client->connections[i].pending);
+        free(client->connections[i].out);
+    }
+    free(client->connections);
+    if (TEMP_FAILURE_RETRY(close(client->wake_fd)) < 0 || TEMP_FAILURE_RETRY(close(client->epoll_fd)) < 0)
+        ERR("close");
+    free(client);
+}
+
+/*
+ * Datagram requests
+ */
+
+/// @brief Open a datagram socket to the server
+/// @param address Server address, or the name of its local datagram socket
+/// @param port Server UDP port, NULL for a local socket
+/// @return Socket file descriptor
+int calc_datagram_open(char *address, char *port)
+{
+    return port ? connect_udp_socket(address, port) : connect_local_dgram_socket(address);
+}
+
+/// @brief Send a request in a datagram and wait for its reply, sending it again after every timeout
+/// @param fd Socket opened with calc_datagram_open
+/// @return Status of the request (0 on success, CALC_CLIENT_TIMEOUT if no reply arrived)
+int32_t calc_datagram_call(int fd, int32_t operand1, int32_t operand2, char operation, int32_t *result)
+{
+    int32_t request[MESSAGE_SIZE] = {0}, reply[MESSAGE_SIZE];
+    request[OPERAND1_INDEX] = htonl(operand1);
+    request[OPERAND2_INDEX] = htonl(operand2);
+    request[OPERATION_INDEX] = htonl(operation);
+    for (int attempt = 0; attempt < CALC_DATAGRAM_ATTEMPTS; attempt++)
+    {
+        if (TEMP_FAILURE_RETRY(send(fd, request, sizeof(request), 0)) < 0 && ECONNREFUSED != errno)
+            ERR("send");
+        struct pollfd pfd = {fd, POLLIN, 0};
+        while (TEMP_FAILURE_RETRY(poll(&pfd, 1, CALC_DATAGRAM_TIMEOUT_MS)) > 0)
+        {
+            ssize_t c = TEMP_FAILURE_RETRY(recv(fd, reply, sizeof(reply), MSG_DONTWAIT));
+            if (c < 0 && (EAGAIN == errno || ECONNREFUSED == errno))
+                continue;
+            if (c < 0)
+                ERR("recv");
+            // Replies echo the request, a late reply to an earlier call does not match it
+            if (sizeof(reply) == c && reply[OPERAND1_INDEX] == request[OPERAND1_INDEX] &&
+                reply[OPERAND2_INDEX] == request[OPERAND2_INDEX] && reply[OPERATION_INDEX] == request[OPERATION_INDEX])
+            {
+                *result = ntohl(reply[RESULT_INDEX]);
+                return ntohl(reply[STATUS_INDEX]);
+            }
+        }
+    }
+    return CALC_CLIENT_TIMEOUT;
+}
+
+/*
+ * Shared-memory requests
+ */
+
+typedef struct
+{
+    int fd; // Local stream connection, it ends when the server goes away
+    shm_region_t *region;
+    int request_fd, reply_fd;
+    unsigned outstanding; // Requests sent and not answered yet, at most SHM_RING_SLOTS
+} calc_shm_t;
+
+/// @brief Connect to the local socket of the server and switch the connection to shared-memory rings
+/// @param name Local socket name of the server
+/// @return Shared-memory client, NULL if the server does not offer the rings
+calc_shm_t *calc_shm_connect(char *name)
+{
+    int fd = connect_local_socket(name), fds[3];
+    int32_t frame[MESSAGE_SIZE] = {0};
+    frame[OPERATION_INDEX] = htonl(OPERATION_SHM);
+    if (bulk_write(fd, (char *)frame, sizeof(frame)) < 0)
+        ERR("write");
+    int count = receive_fds(fd, frame, sizeof(frame), fds, 3);
+    shm_region_t *region = NULL;
+    if (3 == count && 0 == frame[STATUS_INDEX] && NULL == (region = shm_region_map(fds[0])))
+        fprintf(stderr, "Unknown version of the shared-memory rings\n");
+    // The mapping keeps the memory alive, the eventfds are kept if the rings are used
+    for (int i = 0; i < count; i++)
+        if ((0 == i || NULL == region) && TEMP_FAILURE_RETRY(close(fds[i])) < 0)
+            ERR("close");
+    if (NULL == region)
+    {
+        if (TEMP_FAILURE_RETRY(close(fd)) < 0)
+            ERR("close");
+        return NULL;
+    }
+
+    calc_shm_t *shm = malloc(sizeof(calc_shm_t));
+    if (NULL == shm)
+        ERR("malloc");
+    shm->fd = fd;
+    shm->region = region;
+    shm->request_fd = fds[1];
+    shm->reply_fd = fds[2];
+    shm->outstanding = 0;
+    return shm;
+}
+
+/// @brief Send a request through the ring, replies come back in the order of the requests
+/// @return 0 on success, -1 if SHM_RING_SLOTS requests are outstanding already
+int calc_shm_send(calc_shm_t *shm, int32_t operand1, int32_t operand2, char operation)
+{
+    if (SHM_RING_SLOTS == shm->outstanding)
+        return -1;
+    int32_t frame[MESSAGE_SIZE] = {0};
+    frame[OPERAND1_INDEX] = htonl(operand1);
+    frame[OPERAND2_INDEX] = htonl(operand2);
+    frame[OPERATION_INDEX] = htonl(operation);
+    shm_ring_push(&shm->region->requests, frame);
+    shm_ring_notify(&shm->region->requests, shm->request_fd);
+    shm->outstanding++;
+    return 0;
+}
+
+/// @brief Wait for the reply to the oldest outstanding request, spinning for a while before sleeping
+/// @return Status of the request (0 on success, CALC_CLIENT_DISCONNECTED if the server is gone)
+int32_t calc_shm_receive(calc_shm_t *shm, int32_t *result)
+{
+    int32_t frame[MESSAGE_SIZE];
+    shm_ring_t *replies = &shm->region->replies;
+    for (int spin = 0;; spin++)
+    {
+        if (0 == shm_ring_pop(replies, frame))
+        {
+            shm->outstanding--;
+            *result = ntohl(frame[RESULT_INDEX]);
+            return ntohl(frame[STATUS_INDEX]);
+        }
+        if (spin < CALC_SHM_SPIN)
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+            continue;
+        }
+        if (shm_ring_prepare_sleep(replies) < 0)
+            continue;
+
+        // Nothing else ever comes over the connection, it only becomes readable when the server closes it
+        struct pollfd fds[2] = {{shm->reply_fd, POLLIN, 0}, {shm->fd, POLLIN, 0}};
+        if (TEMP_FAILURE_RETRY(poll(fds, 2, -1)) < 0)
+            ERR("poll");
+        if (fds[1].revents)
+            return CALC_CLIENT_DISCONNECTED;
+        uint64_t count;
+        if (TEMP_FAILURE_RETRY(read(shm->reply_fd, &count, sizeof(count))) < 0)
+            ERR("read");
+        spin = 0;
+    }
+}
+
+/// @brief Send a request through the ring and wait for its reply
+/// @return Status of the request (0 on success)
+int32_t calc_shm_call(calc_shm_t *shm, int32_t operand1, int32_t operand2, char operation, int32_t *result)
+{
+    if (calc_shm_send(shm, operand1, operand2, operation) < 0)
+        return CALC_CLIENT_DISCONNECTED;
+    return calc_shm_receive(shm, result);
+}
+
+void calc_shm_close(calc_shm_t *shm)
+{
+    shm_region_unmap(shm->region);
+    if (TEMP_FAILURE_RETRY(close(shm->request_fd)) < 0 || TEMP_FAILURE_RETRY(close(shm->reply_fd)) < 0 ||
+        TEMP_FAILURE_RETRY(close(shm->fd)) < 0)
+        ERR("close");
+    free(shm);
+}
+
+#endif // SOCKETS_CALC_CLIENT_H
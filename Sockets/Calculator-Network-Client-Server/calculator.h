@@ -0,0 +1,187 @@
+//
+// Arithmetic of the calculator server: the scalar primitive used for single requests and the kernels that
+// evaluate whole batches of operations (scalar, SSE4.1 and AVX2, picked at runtime for the running CPU).
+//
+// Batch kernels work directly on network byte order arrays and overwrite the first operands with the results
+// and the second operands with the statuses, so a batch request turns into its reply in place.
+//
+
+#ifndef SOCKETS_CALCULATOR_H
+#define SOCKETS_CALCULATOR_H
+
+#include "socklib.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+/// @brief Evaluate a single operation, wrapping around on overflow like the hardware does
+/// @param operation One of '+', '-', '*', '/'
+/// @param operand1 First operand
+/// @param operand2 Second operand
+/// @param status Set to -1 on an unknown operation or a division by zero, left untouched otherwise
+/// @return Result of the operation (0 on error)
+int32_t calculate(char operation, int32_t operand1, int32_t operand2, int32_t *status)
+{
+    switch (operation)
+    {
+        case '+':
+            return (int32_t)((uint32_t)operand1 + (uint32_t)operand2);
+        case '-':
+            return (int32_t)((uint32_t)operand1 - (uint32_t)operand2);
+        case '*':
+            return (int32_t)((uint32_t)operand1 * (uint32_t)operand2);
+        case '/':
+            if (0 == operand2)
+                break;
+            if (-1 == operand2)
+                return (int32_t)(0u - (uint32_t)operand1); // INT32_MIN / -1 would trap
+            return operand1 / operand2;
+    }
+    *status = -1;
+    return 0;
+}
+
+/// @brief Evaluate a single operation on 64-bit operands (protocol version 2), see calculate
+int64_t calculate64(char operation, int64_t operand1, int64_t operand2, int32_t *status)
+{
+    switch (operation)
+    {
+        case '+':
+            return (int64_t)((uint64_t)operand1 + (uint64_t)operand2);
+        case '-':
+            return (int64_t)((uint64_t)operand1 - (uint64_t)operand2);
+        case '*':
+            return (int64_t)((uint64_t)operand1 * (uint64_t)operand2);
+        case '/':
+            if (0 == operand2)
+                break;
+            if (-1 == operand2)
+                return (int64_t)(0u - (uint64_t)operand1); // INT64_MIN / -1 would trap
+            return operand1 / operand2;
+    }
+    *status = -1;
+    return 0;
+}
+
+/// @brief Batch kernel signature
+/// @param count Number of operations
+/// @param operand1 First operands (network byte order), overwritten with the results
+/// @param operand2 Second operands (network byte order), overwritten with the statuses
+/// @param operation Operations (network byte order)
+typedef void (*batch_kernel_t)(int32_t count, int32_t *operand1, int32_t *operand2, const int32_t *operation);
+
+void calculate_batch_scalar(int32_t count, int32_t *operand1, int32_t *operand2, const int32_t *operation)
+{
+    for (int32_t i = 0; i < count; i++)
+    {
+        int32_t status = 0;
+        int32_t result = calculate((char)ntohl(operation[i]), ntohl(operand1[i]), ntohl(operand2[i]), &status);
+        operand1[i] = htonl(result);
+        operand2[i] = htonl(status);
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("sse4.1"))) void calculate_batch_sse(int32_t count, int32_t *operand1, int32_t *operand2,
+                                                           const int32_t *operation)
+{
+    const __m128i swap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    const __m128i add = _mm_set1_epi32('+'), sub = _mm_set1_epi32('-');
+    const __m128i mul = _mm_set1_epi32('*'), div = _mm_set1_epi32('/');
+    const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi32(1), low_byte = _mm_set1_epi32(0xff);
+    int32_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(operand1 + i)), swap);
+        __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(operand2 + i)), swap);
+        // Only the low byte of the operation word counts, like in calculate
+        __m128i op = _mm_and_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(operation + i)), swap), low_byte);
+
+        __m128i is_add = _mm_cmpeq_epi32(op, add), is_sub = _mm_cmpeq_epi32(op, sub);
+        __m128i is_mul = _mm_cmpeq_epi32(op, mul), is_div = _mm_cmpeq_epi32(op, div);
+        __m128i zero_divisor = _mm_and_si128(is_div, _mm_cmpeq_epi32(b, zero));
+
+        // Divide in double precision (exact for 32-bit operands), with a divisor of 1 in the zero lanes
+        __m128i divisor = _mm_blendv_epi8(b, one, zero_divisor);
+        __m128d low = _mm_div_pd(_mm_cvtepi32_pd(a), _mm_cvtepi32_pd(divisor));
+        __m128d high = _mm_div_pd(_mm_cvtepi32_pd(_mm_unpackhi_epi64(a, a)),
+                                  _mm_cvtepi32_pd(_mm_unpackhi_epi64(divisor, divisor)));
+        __m128i quotient = _mm_unpacklo_epi64(_mm_cvttpd_epi32(low), _mm_cvttpd_epi32(high));
+
+        __m128i result = _mm_and_si128(is_add, _mm_add_epi32(a, b));
+        result = _mm_or_si128(result, _mm_and_si128(is_sub, _mm_sub_epi32(a, b)));
+        result = _mm_or_si128(result, _mm_and_si128(is_mul, _mm_mullo_epi32(a, b)));
+        result = _mm_or_si128(result, _mm_andnot_si128(zero_divisor, _mm_and_si128(is_div, quotient)));
+
+        // Status is -1 (all bits set) in lanes with an unknown operation or a zero divisor
+        __m128i known = _mm_or_si128(_mm_or_si128(is_add, is_sub), _mm_or_si128(is_mul, is_div));
+        __m128i status = _mm_or_si128(_mm_xor_si128(known, _mm_set1_epi32(-1)), zero_divisor);
+
+        _mm_storeu_si128((__m128i *)(operand1 + i), _mm_shuffle_epi8(result, swap));
+        _mm_storeu_si128((__m128i *)(operand2 + i), _mm_shuffle_epi8(status, swap));
+    }
+    calculate_batch_scalar(count - i, operand1 + i, operand2 + i, operation + i);
+}
+
+__attribute__((target("avx2"))) void calculate_batch_avx2(int32_t count, int32_t *operand1, int32_t *operand2,
+                                                         const int32_t *operation)
+{
+    const __m256i swap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+                                         12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    const __m256i add = _mm256_set1_epi32('+'), sub = _mm256_set1_epi32('-');
+    const __m256i mul = _mm256_set1_epi32('*'), div = _mm256_set1_epi32('/');
+    const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi32(1), low_byte = _mm256_set1_epi32(0xff);
+    int32_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i a = _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i *)(operand1 + i)), swap);
+        __m256i b = _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i *)(operand2 + i)), swap);
+        __m256i op = _mm256_and_si256(_mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(operation + i)), swap),
+                                      low_byte);
+
+        __m256i is_add = _mm256_cmpeq_epi32(op, add), is_sub = _mm256_cmpeq_epi32(op, sub);
+        __m256i is_mul = _mm256_cmpeq_epi32(op, mul), is_div = _mm256_cmpeq_epi32(op, div);
+        __m256i zero_divisor = _mm256_and_si256(is_div, _mm256_cmpeq_epi32(b, zero));
+
+        // Divide in double precision (exact for 32-bit operands), with a divisor of 1 in the zero lanes
+        __m256i divisor = _mm256_blendv_epi8(b, one, zero_divisor);
+        __m256d low = _mm256_div_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(a)),
+                                    _mm256_cvtepi32_pd(_mm256_castsi256_si128(divisor)));
+        __m256d high = _mm256_div_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(a, 1)),
+                                     _mm256_cvtepi32_pd(_mm256_extracti128_si256(divisor, 1)));
+        __m256i quotient = _mm256_set_m128i(_mm256_cvttpd_epi32(high), _mm256_cvttpd_epi32(low));
+
+        __m256i result = _mm256_and_si256(is_add, _mm256_add_epi32(a, b));
+        result = _mm256_or_si256(result, _mm256_and_si256(is_sub, _mm256_sub_epi32(a, b)));
+        result = _mm256_or_si256(result, _mm256_and_si256(is_mul, _mm256_mullo_epi32(a, b)));
+        result = _mm256_or_si256(result, _mm256_andnot_si256(zero_divisor, _mm256_and_si256(is_div, quotient)));
+
+        // Status is -1 (all bits set) in lanes with an unknown operation or a zero divisor
+        __m256i known = _mm256_or_si256(_mm256_or_si256(is_add, is_sub), _mm256_or_si256(is_mul, is_div));
+        __m256i status = _mm256_or_si256(_mm256_xor_si256(known, _mm256_set1_epi32(-1)), zero_divisor);
+
+        _mm256_storeu_si256((__m256i *)(operand1 + i), _mm256_shuffle_epi8(result, swap));
+        _mm256_storeu_si256((__m256i *)(operand2 + i), _mm256_shuffle_epi8(status, swap));
+    }
+    calculate_batch_scalar(count - i, operand1 + i, operand2 + i, operation + i);
+}
+
+#endif // HAVE_X86_KERNELS
+
+/// @brief Pick the widest batch kernel the CPU supports, the scalar one off x86
+/// @return Batch kernel
+batch_kernel_t select_batch_kernel(void)
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return calculate_batch_avx2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return calculate_batch_sse;
+#endif
+    return calculate_batch_scalar;
+}
+
+#endif // SOCKETS_CALCULATOR_H
@@ -4,17 +4,30 @@
 
 #include "socklib.h"
 #include "macros.h"
+#include "calc-client.h"
 
 int main(int argc, char **argv)
 {
     int32_t data[5];
+    /*
+     * Send the request in a datagram instead of over a connection with -d
+     */
+
+    int datagram = argc > 1 && 0 == strcmp(argv[1], "-d");
+    if (datagram)
+    {
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
     /*
      * Parse arguments (server address, port number, operand 1, operand 2, operation)
      */
 
     if (argc != 6)
     {
-        fprintf(stderr, "Usage: %s <server_address> <port> <operand1> <operand2> <operation>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-d] <server_address> <port> <operand1> <operand2> <operation>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
@@ -44,40 +57,40 @@ int main(int argc, char **argv)
      * Connect to the server
      */
 
-    int tcp_socket_fd = connect_tcp_socket(argv[1], argv[2]);
+    calc_client_t *client = NULL;
+    int datagram_fd = -1;
+    if (datagram)
+        datagram_fd = calc_datagram_open(argv[1], argv[2]);
+    else
+        client = calc_client_create(argv[1], argv[2], 1);
 
     /*
-     * Send the data to the server
+     * Send the data to the server and receive the result
      */
 
-    // Prepare the data to be sent
-    for(int i = 0; i < 5; i++) data[i] = htonl(data[i]);
-
     // Ignore SIGINT for the time of sending and receiving the data
     sigset_t mask, oldmask;
     sigemptyset(&mask);
     sigaddset(&mask, SIGINT);
     sigprocmask(SIG_BLOCK, &mask, &oldmask);
 
-    if (TEMP_FAILURE_RETRY(bulk_write(tcp_socket_fd, (char *)data, sizeof(data))) < 0)
+    if (datagram)
     {
-        ERR("write");
+        data[STATUS_INDEX] = calc_datagram_call(datagram_fd, data[OPERAND1_INDEX], data[OPERAND2_INDEX],
+                                                (char)data[OPERATION_INDEX], &data[RESULT_INDEX]);
+        if (TEMP_FAILURE_RETRY(close(datagram_fd)) < 0)
+            ERR("close");
     }
-
-
-    /*
-     * Receive the data from the server
-     */
-
-    if (TEMP_FAILURE_RETRY(bulk_read(tcp_socket_fd, (char *)data, sizeof(data))) < 0) {
-        ERR("read");
+    else
+    {
+        data[STATUS_INDEX] = calc_client_call(client, data[OPERAND1_INDEX], data[OPERAND2_INDEX],
+                                              (char)data[OPERATION_INDEX], &data[RESULT_INDEX]);
+        calc_client_destroy(client);
     }
+
     // Restore the old mask
     sigprocmask(SIG_SETMASK, &oldmask, NULL);
 
-    // Convert the data to host byte order
-    for (int i = 0; i < 5; i++) data[i] = ntohl(data[i]);
-
     // Print the result
     if (data[STATUS_INDEX] == 0)
     {
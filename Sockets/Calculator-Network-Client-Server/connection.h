@@ -0,0 +1,316 @@
+//
+// Per-connection state of the calculator server.
+//
+// Every client socket is non-blocking and owns a read buffer (bytes received, possibly ending with a partial
+// frame) and a write buffer (replies that the socket did not accept yet). The server moves the connection
+// between the states below, so that a slow client only ever stalls itself and never the epoll loop.
+//
+
+#ifndef SOCKETS_CONNECTION_H
+#define SOCKETS_CONNECTION_H
+
+#include "socklib.h"
+#include "macros.h"
+#include "worker-pool.h"
+#include "timer-wheel.h"
+#include "shm-ring.h"
+#include "protocol.h"
+#include "trace.h"
+
+#define CONNECTION_BUFFER_SIZE 4096
+#define CONNECTION_PIPELINE 64 // Requests of one connection handed to the worker pool at once
+
+/// @brief Kind of object registered in the epoll instance (first member of every registered structure)
+typedef enum
+{
+    ENDPOINT_LISTENER,
+    ENDPOINT_CONNECTION,
+    ENDPOINT_SHUTDOWN,
+    ENDPOINT_COMPLETIONS,
+    ENDPOINT_DATAGRAM,
+    ENDPOINT_DRAIN,
+    ENDPOINT_SHM_CHANNEL,
+} endpoint_type_t;
+
+typedef struct
+{
+    endpoint_type_t type;
+    int fd;
+} endpoint_t;
+
+typedef enum
+{
+    CONNECTION_READING, // Waiting for (the rest of) a request
+    CONNECTION_WRITING, // Write buffer is full, reading is paused until the client drains its replies
+    CONNECTION_CLOSING, // Client hung up, the remaining replies are flushed before closing
+} connection_state_t;
+
+/// @brief Request handed to the worker pool, its reply is sent once it and all the requests before it are done
+typedef struct
+{
+    pool_job_t job;
+    struct connection *connection;
+    int done;
+    int version;                  // Protocol version the request is encoded in
+    size_t size;                  // Size of the request, then of the reply
+    uint64_t compute_ns;          // Time the worker spent on the request
+    int32_t *data;                // Points to frame, or to a heap buffer for batches, expressions and long version 2 requests
+    int32_t frame[MESSAGE_SIZE];
+} pending_request_t;
+
+/// @brief Shared-memory rings of a local connection, the connection socket only tells when the client is gone
+typedef struct
+{
+    endpoint_t endpoint; // Eventfd written by the client when the server has to wake up for new requests
+    struct connection *connection;
+    shm_region_t *region;
+    int reply_fd; // Eventfd the client waits for
+    int epoll_fd; // Epoll instance watching the endpoint
+} shm_channel_t;
+
+typedef struct connection
+{
+    endpoint_t endpoint;
+    uint32_t id; // Identifies the connection in captured traces
+    connection_state_t state;
+    int version;           // Protocol version of the requests and replies, PROTOCOL_V1 until negotiated
+    int registered;        // Whether the socket was added to the epoll instance
+    uint32_t epoll_events; // Events currently registered for the socket
+    size_t read_length;
+    size_t write_offset, write_length;
+    char read_buffer[CONNECTION_BUFFER_SIZE];
+    char write_buffer[CONNECTION_BUFFER_SIZE];
+
+    // Worker pool mode only: the requests in the pool form a ring, replies leave in the order of the requests
+    completion_queue_t *completions; // NULL if the requests are computed inline
+    pending_request_t *pending;
+    unsigned pending_head, pending_tail;
+    unsigned in_flight; // Requests still in the pool, the connection cannot be freed before they return
+
+    int local;              // Whether the client connected to the local socket
+    shm_channel_t *channel; // Shared-memory rings, NULL until the client asks for them
+
+    wheel_timer_t idle_timer; // Closes the connection once it has been idle for idle_timeout_ms
+    struct connection *next_closed;
+} connection_t;
+
+/// @brief Connections of the calling reactor that were closed but not freed yet: other events of the current
+/// epoll batch (or requests still in the worker pool) may refer to them
+__thread connection_t *closed_connections;
+
+/// @brief Number of connections of the calling reactor that are not closed yet
+__thread size_t open_connections;
+
+/// @brief Idle timers of the connections of the calling reactor, NULL if connections never time out
+__thread timer_wheel_t *idle_timers;
+uint64_t idle_timeout_ms;
+
+/// @brief Allocate the state of a new connection
+/// @param fd Client socket file descriptor (must already be non-blocking)
+/// @return Connection state
+connection_t *connection_create(int fd)
+{
+    connection_t *connection = malloc(sizeof(connection_t));
+    if (NULL == connection)
+        ERR("malloc");
+    connection->endpoint.type = ENDPOINT_CONNECTION;
+    connection->endpoint.fd = fd;
+    connection->id = __atomic_add_fetch(&next_connection_id, 1, __ATOMIC_RELAXED);
+    connection->state = CONNECTION_READING;
+    connection->version = PROTOCOL_V1;
+    connection->registered = 0;
+    connection->epoll_events = 0;
+    connection->read_length = 0;
+    connection->write_offset = 0;
+    connection->write_length = 0;
+    connection->completions = NULL;
+    connection->pending = NULL;
+    connection->pending_head = connection->pending_tail = 0;
+    connection->in_flight = 0;
+    connection->local = 0;
+    connection->channel = NULL;
+    wheel_timer_init(&connection->idle_timer);
+    open_connections++;
+    return connection;
+}
+
+/// @brief Hand the requests of the connection to the worker pool
+/// @param connection Connection state
+/// @param completions Completion queue of the reactor owning the connection
+void connection_use_pool(connection_t *connection, completion_queue_t *completions)
+{
+    connection->completions = completions;
+    if (NULL == (connection->pending = calloc(CONNECTION_PIPELINE, sizeof(pending_request_t))))
+        ERR("calloc");
+}
+
+/// @brief Free the connection state (the socket must already be closed)
+void connection_free(connection_t *connection)
+{
+    for (unsigned i = connection->pending_head; i != connection->pending_tail; i++)
+    {
+        pending_request_t *pending = &connection->pending[i % CONNECTION_PIPELINE];
+        if (pending->data != pending->frame)
+            free(pending->data);
+    }
+    free(connection->pending);
+    if (connection->channel)
+    {
+        if (TEMP_FAILURE_RETRY(close(connection->channel->endpoint.fd)) < 0 ||
+            TEMP_FAILURE_RETRY(close(connection->channel->reply_fd)) < 0)
+            ERR("close");
+        shm_region_unmap(connection->channel->region);
+        free(connection->channel);
+    }
+    free(connection);
+}
+
+/// @brief Capture a request of the connection (or its end, with a size of 0) if requests are captured
+void connection_trace(connection_t *connection, const void *data, size_t size)
+{
+    if (thread_trace)
+        trace_request(connection->local ? TRACE_LOCAL : TRACE_TCP, connection->id, data, size);
+}
+
+/// @brief Close the client socket (which also removes it from epoll), the connection state is freed by
+/// connection_free_closed once nothing refers to it anymore
+/// @param connection Connection state
+void connection_destroy(connection_t *connection)
+{
+    // The client shares the eventfd, closing it would not remove it from epoll
+    if (connection->channel && epoll_ctl(connection->channel->epoll_fd, EPOLL_CTL_DEL,
+                                         connection->channel->endpoint.fd, NULL) < 0)
+        ERR("epoll_ctl");
+    if (TEMP_FAILURE_RETRY(close(connection->endpoint.fd)) < 0)
+        ERR("close");
+    connection->endpoint.fd = -1;
+    open_connections--;
+    connection_trace(connection, NULL, 0);
+    if (idle_timers)
+        timer_wheel_cancel(idle_timers, &connection->idle_timer);
+    connection->next_closed = closed_connections;
+    closed_connections = connection;
+}
+
+/// @brief Free the closed connections of the calling reactor that have no requests in the worker pool,
+/// to be called between epoll batches
+void connection_free_closed(void)
+{
+    connection_t **link = &closed_connections;
+    while (*link)
+    {
+        connection_t *connection = *link;
+        if (connection->in_flight > 0)
+        {
+            link = &connection->next_closed;
+            continue;
+        }
+        *link = connection->next_closed;
+        connection_free(connection);
+    }
+}
+
+/// @brief Restart the idle timeout of the connection, after some activity on it
+/// @param connection Connection state
+void connection_touch(connection_t *connection)
+{
+    if (idle_timers)
+        timer_wheel_arm(idle_timers, &connection->idle_timer, idle_timeout_ms);
+}
+
+/// @brief Read as much as fits into the read buffer without blocking
+/// @param connection Connection state
+/// @return 1 if the socket may still be read, 0 on end of file, -1 if the connection is broken
+int connection_fill(connection_t *connection)
+{
+    while (connection->read_length < CONNECTION_BUFFER_SIZE)
+    {
+        ssize_t c = TEMP_FAILURE_RETRY(read(connection->endpoint.fd, connection->read_buffer + connection->read_length,
+                                            CONNECTION_BUFFER_SIZE - connection->read_length));
+        if (c < 0)
+        {
+            if (EAGAIN == errno || EWOULDBLOCK == errno)
+                return 1;
+            // Any other error (reset, timeout, unreachable peer...) only breaks this connection
+            return -1;
+        }
+        if (0 == c)
+            return 0;
+        connection->read_length += c;
+    }
+    return 1;
+}
+
+/// @brief Drop the first count bytes of the read buffer, keeping a trailing partial frame
+/// @param connection Connection state
+/// @param count Number of consumed bytes
+void connection_consume(connection_t *connection, size_t count)
+{
+    connection->read_length -= count;
+    if (connection->read_length > 0)
+        memmove(connection->read_buffer, connection->read_buffer + count, connection->read_length);
+}
+
+/// @brief Free space at the end of the write buffer
+size_t connection_write_space(connection_t *connection)
+{
+    return CONNECTION_BUFFER_SIZE - connection->write_length;
+}
+
+/// @brief Drop the written part of the write buffer, moving the unsent tail to the front,
+/// so the buffer always has a contiguous free space at the end
+/// @param connection Connection state
+void connection_consume_written(connection_t *connection)
+{
+    connection->write_length -= connection->write_offset;
+    if (connection->write_length > 0 && connection->write_offset > 0)
+        memmove(connection->write_buffer, connection->write_buffer + connection->write_offset, connection->write_length);
+    connection->write_offset = 0;
+}
+
+/// @brief Write as much of the write buffer as the socket accepts without blocking
+/// @param connection Connection state
+/// @return 0 on success (the buffer may still be non-empty), -1 if the connection is broken
+int connection_flush(connection_t *connection)
+{
+    while (connection->write_offset < connection->write_length)
+    {
+        ssize_t c = TEMP_FAILURE_RETRY(write(connection->endpoint.fd, connection->write_buffer + connection->write_offset,
+                                             connection->write_length - connection->write_offset));
+        if (c < 0)
+        {
+            if (EAGAIN == errno || EWOULDBLOCK == errno)
+                break;
+            return -1;
+        }
+        connection->write_offset += c;
+    }
+
+    connection_consume_written(connection);
+    return 0;
+}
+
+/// @brief Register the events the connection is interested in its current state
+/// @param epoll_fd Epoll instance
+/// @param connection Connection state
+void connection_update_events(int epoll_fd, connection_t *connection)
+{
+    uint32_t events = 0;
+    if (CONNECTION_READING == connection->state)
+        events |= EPOLLIN;
+    if (connection->write_length > 0)
+        events |= EPOLLOUT;
+    if (connection->registered && events == connection->epoll_events)
+        return;
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = connection;
+    int op = connection->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(epoll_fd, op, connection->endpoint.fd, &ev) < 0)
+        ERR("epoll_ctl");
+    connection->registered = 1;
+    connection->epoll_events = events;
+}
+
+#endif // SOCKETS_CONNECTION_H
@@ -0,0 +1,103 @@
+//
+// Datagram transport of the calculator server (UDP and local SOCK_DGRAM sockets).
+//
+// Every datagram carries exactly one request (a frame or a batch frame) and is answered with one datagram sent
+// back to its source. Datagrams are received and sent DATAGRAM_BATCH at a time with recvmmsg and sendmmsg; the
+// requests are turned into their replies in place, so a batch costs two system calls and no copies.
+//
+
+#ifndef SOCKETS_DATAGRAM_H
+#define SOCKETS_DATAGRAM_H
+
+#include "socklib.h"
+#include "macros.h"
+
+#define DATAGRAM_BATCH 64
+#define DATAGRAM_BUFFER_SIZE BATCH_REQUEST_SIZE(BATCH_MAX)
+
+typedef struct
+{
+    struct mmsghdr messages[DATAGRAM_BATCH];
+    struct iovec iovecs[DATAGRAM_BATCH];
+    struct sockaddr_storage addresses[DATAGRAM_BATCH];
+    int32_t buffers[DATAGRAM_BATCH][DATAGRAM_BUFFER_SIZE / sizeof(int32_t)];
+} datagram_batch_t;
+
+datagram_batch_t *datagram_batch_create(void)
+{
+    datagram_batch_t *batch = malloc(sizeof(datagram_batch_t));
+    if (NULL == batch)
+        ERR("malloc");
+    return batch;
+}
+
+/// @brief Whether a datagram system call failed because of the server itself rather than a peer or the network
+/// @param error errno of the call
+/// @return 1 for a programming error, 0 if only the datagrams of that call are lost
+int datagram_local_error(int error)
+{
+    return EBADF == error || EFAULT == error || ENOTSOCK == error;
+}
+
+/// @brief Receive up to DATAGRAM_BATCH datagrams without blocking
+/// @param batch Batch, the datagrams are in buffers, their sizes in messages[i].msg_len
+/// @param fd Datagram socket
+/// @return Number of datagrams received, 0 if none is pending or the socket reported an error
+int datagram_receive(datagram_batch_t *batch, int fd)
+{
+    for (int i = 0; i < DATAGRAM_BATCH; i++)
+    {
+        batch->iovecs[i].iov_base = batch->buffers[i];
+        batch->iovecs[i].iov_len = DATAGRAM_BUFFER_SIZE;
+        memset(&batch->messages[i].msg_hdr, 0, sizeof(struct msghdr));
+        batch->messages[i].msg_hdr.msg_iov = &batch->iovecs[i];
+        batch->messages[i].msg_hdr.msg_iovlen = 1;
+        batch->messages[i].msg_hdr.msg_name = &batch->addresses[i];
+        batch->messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+    }
+    int count = TEMP_FAILURE_RETRY(recvmmsg(fd, batch->messages, DATAGRAM_BATCH, MSG_DONTWAIT, NULL));
+    if (count < 0)
+    {
+        if (datagram_local_error(errno))
+            ERR("recvmmsg");
+        // A pending error of the socket (an ICMP error about an earlier reply, no memory...) is not ours to fix,
+        // whatever is still queued is received on the next call
+        return 0;
+    }
+    return count;
+}
+
+/// @brief Send the replies of a batch back to the sources of the requests.
+/// A message with an iov_len of 0 is skipped. Replies the socket cannot take right now or cannot deliver
+/// (full buffers, a client that is gone, a source address that cannot be answered such as port 0 or a
+/// broadcast address) are dropped, like the network would, and the clients are expected to retry.
+/// @param batch Batch received with datagram_receive, iovecs[i].iov_len set to the size of each reply
+/// @param fd Datagram socket
+/// @param count Number of messages in the batch
+/// @return Number of replies dropped
+int datagram_send(datagram_batch_t *batch, int fd, int count)
+{
+    // Pack the replies to the front, the headers point to their own buffers and addresses
+    int n_replies = 0;
+    for (int i = 0; i < count; i++)
+        if (batch->iovecs[i].iov_len > 0)
+            batch->messages[n_replies++].msg_hdr = batch->messages[i].msg_hdr;
+
+    int sent = 0, dropped = 0;
+    while (sent < n_replies)
+    {
+        int c = TEMP_FAILURE_RETRY(sendmmsg(fd, batch->messages + sent, n_replies - sent, MSG_DONTWAIT));
+        if (c < 0)
+        {
+            if (datagram_local_error(errno))
+                ERR("sendmmsg");
+            // The reply of the first message cannot be delivered, whatever the peer sent must not stop the server
+            c = 1;
+            dropped++;
+        }
+        sent += c;
+    }
+    return dropped;
+}
+
+#endif // SOCKETS_DATAGRAM_H
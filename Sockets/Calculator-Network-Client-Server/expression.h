@@ -0,0 +1,287 @@
+//
+// Expression requests of the calculator server.
+//
+// An infix expression over the variables of a tuple (a, b, c, ...) is compiled once into a postfix bytecode and
+// kept in a per-thread plan cache, keyed by the hash of its text, so clients sending the same expression again only
+// pay for the evaluation. Plans run a column at a time: every instruction is applied to all the tuples of the
+// request before the next one is decoded, which keeps the interpreter dispatch out of the inner loops. The
+// arithmetic of every step is the one of single requests (calculate), wrapping around on overflow.
+//
+
+#ifndef SOCKETS_EXPRESSION_H
+#define SOCKETS_EXPRESSION_H
+
+#include "socklib.h"
+#include "macros.h"
+#include "calculator.h"
+#include <pthread.h>
+
+#define EXPRESSION_MAX_STACK 16   // Deepest evaluation stack of a plan (nesting of the expression)
+#define EXPRESSION_CACHE_SLOTS 64 // Plans cached per thread, a power of two
+
+typedef enum
+{
+    EXPRESSION_VARIABLE, // Push a variable of the tuple (argument: its index)
+    EXPRESSION_CONSTANT, // Push a constant (argument: its value)
+    EXPRESSION_NEGATE,
+    EXPRESSION_BINARY, // Pop two values and push the result (argument: the operation, one of '+', '-', '*', '/')
+} expression_opcode_t;
+
+typedef struct
+{
+    expression_opcode_t opcode;
+    int32_t argument;
+} expression_instruction_t;
+
+typedef struct
+{
+    uint64_t hash;
+    size_t length; // 0 if the slot is empty
+    char text[EXPRESSION_MAX_LENGTH];
+    int valid;     // Whether the expression compiled, invalid expressions are cached too
+    int variables; // Number of variables a tuple needs (highest variable used + 1)
+    int n_instructions;
+    expression_instruction_t code[EXPRESSION_MAX_LENGTH];
+} expression_plan_t;
+
+/// @brief Plans compiled by the calling thread, allocated on first use and freed when the thread exits
+__thread expression_plan_t *expression_cache;
+pthread_key_t expression_cache_key;
+pthread_once_t expression_cache_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Compiler: recursive descent over
+ *   sum     := product (('+' | '-') product)*
+ *   product := unary (('*' | '/') unary)*
+ *   unary   := '-' unary | primary
+ *   primary := variable | constant | '(' sum ')'
+ * emitting the postfix code of every rule as soon as its operands are emitted.
+ */
+
+typedef struct
+{
+    const char *text;
+    size_t length, position;
+    expression_plan_t *plan;
+    int depth, max_depth; // Stack depth reached by the code emitted so far
+} expression_parser_t;
+
+char expression_peek(expression_parser_t *parser)
+{
+    while (parser->position < parser->length && ' ' == parser->text[parser->position])
+        parser->position++;
+    return parser->position < parser->length ? parser->text[parser->position] : '\0';
+}
+
+void expression_emit(expression_parser_t *parser, expression_opcode_t opcode, int32_t argument)
+{
+    expression_plan_t *plan = parser->plan;
+    plan->code[plan->n_instructions].opcode = opcode;
+    plan->code[plan->n_instructions++].argument = argument;
+    if (EXPRESSION_VARIABLE == opcode || EXPRESSION_CONSTANT == opcode)
+        parser->depth++;
+    else if (EXPRESSION_BINARY == opcode)
+        parser->depth--;
+    if (parser->depth > parser->max_depth)
+        parser->max_depth = parser->depth;
+}
+
+int expression_parse_sum(expression_parser_t *parser);
+
+/// @return 0 on success, -1 on a syntax error
+int expression_parse_primary(expression_parser_t *parser)
+{
+    char c = expression_peek(parser);
+    if (c >= 'a' && c <= 'z' && c - 'a' < EXPRESSION_MAX_VARIABLES)
+    {
+        parser->position++;
+        if (c - 'a' + 1 > parser->plan->variables)
+            parser->plan->variables = c - 'a' + 1;
+        expression_emit(parser, EXPRESSION_VARIABLE, c - 'a');
+        return 0;
+    }
+    if (c >= '0' && c <= '9')
+    {
+        int64_t value = 0;
+        while (parser->position < parser->length && parser->text[parser->position] >= '0' &&
+               parser->text[parser->position] <= '9')
+            if ((value = 10 * value + parser->text[parser->position++] - '0') > INT32_MAX)
+                return -1;
+        expression_emit(parser, EXPRESSION_CONSTANT, (int32_t)value);
+        return 0;
+    }
+    if ('(' != c)
+        return -1;
+    parser->position++;
+    if (expression_parse_sum(parser) < 0 || ')' != expression_peek(parser))
+        return -1;
+    parser->position++;
+    return 0;
+}
+
+int expression_parse_unary(expression_parser_t *parser)
+{
+    if ('-' != expression_peek(parser))
+        return expression_parse_primary(parser);
+    parser->position++;
+    if (expression_parse_unary(parser) < 0)
+        return -1;
+    expression_emit(parser, EXPRESSION_NEGATE, 0);
+    return 0;
+}
+
+int expression_parse_product(expression_parser_t *parser)
+{
+    if (expression_parse_unary(parser) < 0)
+        return -1;
+    for (char c = expression_peek(parser); '*' == c || '/' == c; c = expression_peek(parser))
+    {
+        parser->position++;
+        if (expression_parse_unary(parser) < 0)
+            return -1;
+        expression_emit(parser, EXPRESSION_BINARY, c);
+    }
+    return 0;
+}
+
+int expression_parse_sum(expression_parser_t *parser)
+{
+    if (expression_parse_product(parser) < 0)
+        return -1;
+    for (char c = expression_peek(parser); '+' == c || '-' == c; c = expression_peek(parser))
+    {
+        parser->position++;
+        if (expression_parse_product(parser) < 0)
+            return -1;
+        expression_emit(parser, EXPRESSION_BINARY, c);
+    }
+    return 0;
+}
+
+/// @brief Compile an expression into a plan
+/// @param plan Plan, its text and length must be set
+void expression_compile(expression_plan_t *plan)
+{
+    expression_parser_t parser = {plan->text, plan->length, 0, plan, 0, 0};
+    plan->variables = 0;
+    plan->n_instructions = 0;
+    // Every instruction consumes at least one character, so the code always fits
+    plan->valid = 0 == expression_parse_sum(&parser) && '\0' == expression_peek(&parser) &&
+                  parser.max_depth <= EXPRESSION_MAX_STACK;
+}
+
+/*
+ * Plan cache
+ */
+
+/// @brief FNV-1a hash of the text of an expression
+uint64_t expression_hash(const char *text, size_t length)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (uint8_t)text[i]) * 1099511628211ull;
+    return hash;
+}
+
+void expression_cache_free(void *cache)
+{
+    free(cache);
+}
+
+void expression_cache_key_create(void)
+{
+    if (pthread_key_create(&expression_cache_key, expression_cache_free))
+        ERR("pthread_key_create");
+}
+
+/// @brief Find the plan of an expression in the cache of the calling thread, compiling it on a miss
+/// @param text Expression (not terminated)
+/// @param length Length of the expression, 1-EXPRESSION_MAX_LENGTH
+/// @return Plan, valid until the next call on the same thread
+const expression_plan_t *expression_plan(const char *text, size_t length)
+{
+    if (NULL == expression_cache)
+    {
+        pthread_once(&expression_cache_once, expression_cache_key_create);
+        if (NULL == (expression_cache = calloc(EXPRESSION_CACHE_SLOTS, sizeof(expression_plan_t))))
+            ERR("calloc");
+        if (pthread_setspecific(expression_cache_key, expression_cache))
+            ERR("pthread_setspecific");
+    }
+    uint64_t hash = expression_hash(text, length);
+    expression_plan_t *plan = &expression_cache[hash & (EXPRESSION_CACHE_SLOTS - 1)];
+    if (plan->hash == hash && plan->length == length && 0 == memcmp(plan->text, text, length))
+        return plan;
+    plan->hash = hash;
+    plan->length = length;
+    memcpy(plan->text, text, length);
+    expression_compile(plan);
+    return plan;
+}
+
+/*
+ * Interpreter
+ */
+
+/// @brief Evaluate an expression on every tuple of a request
+/// @param text Expression (not terminated)
+/// @param length Length of the expression, 1-EXPRESSION_MAX_LENGTH
+/// @param variables Number of variables in a tuple
+/// @param count Number of tuples, 1-EXPRESSION_MAX_TUPLES
+/// @param tuples Tuples (network byte order), one after another
+/// @param results Set to the results (network byte order), may overlap the text and the tuples
+/// @param statuses Set to the statuses (network byte order), may overlap the text and the tuples
+/// @return 0 on success, -1 if the expression does not compile or needs more variables than the tuples have
+int32_t expression_evaluate(const char *text, size_t length, int32_t variables, int32_t count, const int32_t *tuples,
+                            int32_t *results, int32_t *statuses)
+{
+    const expression_plan_t *plan = expression_plan(text, length);
+    if (!plan->valid || plan->variables > variables)
+    {
+        for (int32_t i = 0; i < count; i++)
+        {
+            results[i] = 0;
+            statuses[i] = htonl(-1);
+        }
+        return -1;
+    }
+
+    int32_t stack[EXPRESSION_MAX_STACK][EXPRESSION_MAX_TUPLES], status[EXPRESSION_MAX_TUPLES] = {0};
+    int top = -1;
+    for (int pc = 0; pc < plan->n_instructions; pc++)
+    {
+        const expression_instruction_t *instruction = &plan->code[pc];
+        switch (instruction->opcode)
+        {
+            case EXPRESSION_VARIABLE:
+                top++;
+                for (int32_t i = 0; i < count; i++)
+                    stack[top][i] = ntohl(tuples[i * variables + instruction->argument]);
+                break;
+            case EXPRESSION_CONSTANT:
+                top++;
+                for (int32_t i = 0; i < count; i++)
+                    stack[top][i] = instruction->argument;
+                break;
+            case EXPRESSION_NEGATE:
+                for (int32_t i = 0; i < count; i++)
+                    stack[top][i] = (int32_t)(0u - (uint32_t)stack[top][i]);
+                break;
+            case EXPRESSION_BINARY:
+                top--;
+                for (int32_t i = 0; i < count; i++)
+                    stack[top][i] = calculate((char)instruction->argument, stack[top][i], stack[top + 1][i], &status[i]);
+                break;
+        }
+    }
+
+    // Every tuple was read into the stack, the reply may overwrite the request now
+    for (int32_t i = 0; i < count; i++)
+    {
+        results[i] = htonl(stack[0][i]);
+        statuses[i] = htonl(status[i]);
+    }
+    return 0;
+}
+
+#endif // SOCKETS_EXPRESSION_H
@@ -0,0 +1,111 @@
+//
+// HDR-style latency histogram: log-linear buckets with HISTOGRAM_SUB_BUCKETS linear sub-buckets per power of two,
+// so every recorded value is kept with a relative error below 1 / HISTOGRAM_SUB_BUCKETS over the whole 64-bit range.
+//
+// A histogram has a single writer; the counters are updated with relaxed atomic stores, so other threads may read
+// (or merge) a histogram while it is being written and see a slightly stale but never torn state.
+//
+
+#ifndef SOCKETS_HISTOGRAM_H
+#define SOCKETS_HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define HISTOGRAM_SUB_BITS 6
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS) * HISTOGRAM_SUB_BUCKETS + 2 * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+void histogram_init(histogram_t *histogram)
+{
+    memset(histogram, 0, sizeof(histogram_t));
+}
+
+/// @brief Index of the bucket holding a value
+int histogram_index(uint64_t value)
+{
+    if (value < 2 * HISTOGRAM_SUB_BUCKETS)
+        return (int)value;
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return shift * HISTOGRAM_SUB_BUCKETS + (int)(value >> shift);
+}
+
+/// @brief Smallest value that falls into a bucket
+uint64_t histogram_lower_bound(int index)
+{
+    if (index < 2 * HISTOGRAM_SUB_BUCKETS)
+        return index;
+    int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    return (uint64_t)(index % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS) << shift;
+}
+
+/// @brief Record a value (only from the thread owning the histogram)
+void histogram_record(histogram_t *histogram, uint64_t value)
+{
+    uint64_t *bucket = &histogram->buckets[histogram_index(value)];
+    __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->count, histogram->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->sum, histogram->sum + value, __ATOMIC_RELAXED);
+    if (value > histogram->max)
+        __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+}
+
+/// @brief Add the values recorded in one histogram to another one
+/// @param destination Histogram owned by the calling thread
+/// @param source Histogram to add (may be written concurrently)
+void histogram_merge(histogram_t *destination, const histogram_t *source)
+{
+    uint64_t count = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        uint64_t c = __atomic_load_n(&source->buckets[i], __ATOMIC_RELAXED);
+        destination->buckets[i] += c;
+        count += c;
+    }
+    // Recount instead of reading source->count, so the total matches the buckets
+    destination->count += count;
+    destination->sum += __atomic_load_n(&source->sum, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&source->max, __ATOMIC_RELAXED);
+    if (max > destination->max)
+        destination->max = max;
+}
+
+/// @brief Value below which the given fraction of the recorded values lies
+/// @param histogram Histogram
+/// @param quantile Quantile (0.5 for the median, 0.999 for p99.9)
+/// @return Representative value (middle of the bucket), 0 if the histogram is empty
+uint64_t histogram_quantile(const histogram_t *histogram, double quantile)
+{
+    if (0 == histogram->count)
+        return 0;
+    uint64_t rank = (uint64_t)(quantile * histogram->count), seen = 0;
+    if (rank >= histogram->count)
+        rank = histogram->count - 1;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen > rank)
+        {
+            uint64_t low = histogram_lower_bound(i), high = histogram_lower_bound(i + 1);
+            uint64_t value = low + (high - low) / 2;
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+/// @brief Mean of the recorded values
+double histogram_mean(const histogram_t *histogram)
+{
+    return histogram->count ? (double)histogram->sum / histogram->count : 0.0;
+}
+
+#endif // SOCKETS_HISTOGRAM_H
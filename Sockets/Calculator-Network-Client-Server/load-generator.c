@@ -0,0 +1,388 @@
+//
+// Load generator for the calculator server.
+//
+// Closed-loop mode (default): every connection keeps a fixed number of requests in flight and sends a new one
+// as soon as a reply arrives, so the offered load adapts to the server.
+// Open-loop mode (-r): requests are issued at the given total rate with exponentially distributed gaps (a Poisson
+// process), independently of the replies. Latency is measured from the time a request was scheduled, not from when
+// it could be sent, so a stalled server cannot hide its queueing delay (coordinated omission).
+//
+
+#include "socklib.h"
+#include "macros.h"
+#include "histogram.h"
+#include "protocol.h"
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+
+#define MAX_THREADS 256
+#define MAX_CONNECTIONS 1024 // Per thread
+#define FRAME_SIZE sizeof(int32_t[MESSAGE_SIZE])
+#define OUT_BUFFER_SIZE (256 * FRAME_SIZE)
+
+typedef struct
+{
+    int fd;
+    uint64_t *sent_at; // Scheduled send times of the requests in flight (FIFO, replies come back in order)
+    size_t head, tail, capacity;
+    size_t owed;       // Requests scheduled but not yet written to the socket
+    int version; // Protocol version agreed on with the server
+    char in[FRAME_SIZE];
+    size_t in_length;
+    char out[OUT_BUFFER_SIZE];
+    size_t out_length;
+} lg_connection_t;
+
+typedef struct
+{
+    // Configuration
+    char *address, *port;
+    int connections, depth;
+    int version; // Protocol version to ask for
+    double rate; // Requests per second of this thread, 0 in closed-loop mode
+    uint64_t duration_ns;
+    unsigned seed;
+
+    // Results
+    pthread_t thread;
+    histogram_t latency;
+    uint64_t completed, errors;
+    uint64_t bytes_sent, bytes_received;
+} lg_thread_t;
+
+void usage(char *name)
+{
+    fprintf(stderr, "Usage: %s [-t threads] [-c connections] [-d depth] [-r rate] [-s seconds] [-p protocol] "
+                    "<local socket name | server address> [port]\n", name);
+    fprintf(stderr, "  threads: number of load generating threads (default 1)\n");
+    fprintf(stderr, "  connections: connections per thread (default 1)\n");
+    fprintf(stderr, "  depth: requests in flight per connection in closed-loop mode (default 1)\n");
+    fprintf(stderr, "  rate: total requests per second, switches to open-loop mode\n");
+    fprintf(stderr, "  seconds: duration of the run (default 10)\n");
+    fprintf(stderr, "  protocol: wire protocol version, 1 or 2 (default 2, falls back to 1 if the server does not know it)\n");
+    fprintf(stderr, "  without a port the server is reached through the local socket\n");
+    exit(EXIT_FAILURE);
+}
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void push_sent(lg_connection_t *connection, uint64_t time)
+{
+    if (connection->tail - connection->head == connection->capacity)
+    {
+        // Grow the FIFO, unwrapping it into the new array
+        size_t capacity = 2 * connection->capacity;
+        uint64_t *sent_at = malloc(capacity * sizeof(uint64_t));
+        if (NULL == sent_at)
+            ERR("malloc");
+        for (size_t i = connection->head; i < connection->tail; i++)
+            sent_at[i - connection->head] = connection->sent_at[i % connection->capacity];
+        free(connection->sent_at);
+        connection->sent_at = sent_at;
+        connection->tail -= connection->head;
+        connection->head = 0;
+        connection->capacity = capacity;
+    }
+    connection->sent_at[connection->tail++ % connection->capacity] = time;
+}
+
+/// @brief Append the owed requests that fit into the output buffer, with random operands and operations
+void fill_requests(lg_connection_t *connection, unsigned *seed)
+{
+    static const char operations[] = "+-*/";
+    while (connection->owed > 0 && OUT_BUFFER_SIZE - connection->out_length >= FRAME_SIZE)
+    {
+        int32_t operand1 = rand_r(seed) % 1000, operand2 = 1 + rand_r(seed) % 1000;
+        char operation = operations[rand_r(seed) % 4];
+        if (PROTOCOL_V2 == connection->version)
+            connection->out_length += v2_encode_request((uint8_t *)connection->out + connection->out_length,
+                                                        operation, operand1, operand2);
+        else
+        {
+            int32_t data[MESSAGE_SIZE];
+            data[OPERAND1_INDEX] = htonl(operand1);
+            data[OPERAND2_INDEX] = htonl(operand2);
+            data[RESULT_INDEX] = 0;
+            data[OPERATION_INDEX] = htonl(operation);
+            data[STATUS_INDEX] = 0;
+            memcpy(connection->out + connection->out_length, data, FRAME_SIZE);
+            connection->out_length += FRAME_SIZE;
+        }
+        connection->owed--;
+    }
+}
+
+/// @brief Write the output buffer without blocking
+void flush_requests(lg_thread_t *args, lg_connection_t *connection)
+{
+    ssize_t c = TEMP_FAILURE_RETRY(write(connection->fd, connection->out, connection->out_length));
+    if (c < 0)
+    {
+        if (EAGAIN == errno || EWOULDBLOCK == errno)
+            return;
+        ERR("write");
+    }
+    args->bytes_sent += c;
+    connection->out_length -= c;
+    memmove(connection->out, connection->out + c, connection->out_length);
+}
+
+/// @brief Read the available replies and record their latencies
+/// @return Number of replies received
+int read_replies(lg_thread_t *args, lg_connection_t *connection, uint64_t now)
+{
+    char buffer[64 * FRAME_SIZE];
+    int replies = 0;
+    ssize_t c = TEMP_FAILURE_RETRY(read(connection->fd, buffer, sizeof(buffer)));
+    if (c < 0)
+    {
+        if (EAGAIN == errno || EWOULDBLOCK == errno)
+            return 0;
+        ERR("read");
+    }
+    if (0 == c)
+    {
+        fprintf(stderr, "Server closed the connection\n");
+        exit(EXIT_FAILURE);
+    }
+    args->bytes_received += c;
+    for (ssize_t i = 0; i < c; i++)
+    {
+        int32_t status;
+        connection->in[connection->in_length++] = buffer[i];
+        if (PROTOCOL_V2 == connection->version)
+        {
+            int64_t result;
+            int size = v2_decode_reply((uint8_t *)connection->in, connection->in_length, &status, &result);
+            if (size < 0)
+            {
+                fprintf(stderr, "Malformed reply\n");
+                exit(EXIT_FAILURE);
+            }
+            if (0 == size)
+                continue;
+        }
+        else
+        {
+            if (connection->in_length < FRAME_SIZE)
+                continue;
+            memcpy(&status, connection->in + STATUS_INDEX * sizeof(int32_t), sizeof(status));
+            status = ntohl(status);
+        }
+        connection->in_length = 0;
+
+        if (0 != status)
+            args->errors++;
+        uint64_t sent_at = connection->sent_at[connection->head++ % connection->capacity];
+        histogram_record(&args->latency, now - sent_at);
+        args->completed++;
+        replies++;
+    }
+    return replies;
+}
+
+/// @brief Draw the gap to the next request of a Poisson process
+uint64_t next_gap_ns(double rate, unsigned *seed)
+{
+    double u = (rand_r(seed) + 1.0) / ((double)RAND_MAX + 2.0);
+    return (uint64_t)(-log(u) / rate * 1e9);
+}
+
+void *thread_work(void *arg)
+{
+    lg_thread_t *args = arg;
+    lg_connection_t *connections = calloc(args->connections, sizeof(lg_connection_t));
+    struct pollfd *fds = calloc(args->connections, sizeof(struct pollfd));
+    if (NULL == connections || NULL == fds)
+        ERR("calloc");
+
+    for (int i = 0; i < args->connections; i++)
+    {
+        connections[i].fd = args->port ? connect_tcp_socket(args->address, args->port) : connect_local_socket(args->address);
+        connections[i].version = PROTOCOL_V1;
+        if (PROTOCOL_V2 == args->version)
+            connections[i].version = protocol_negotiate(connections[i].fd, PROTOCOL_V2);
+        if (connections[i].version < 0)
+        {
+            fprintf(stderr, "Server closed the connection\n");
+            exit(EXIT_FAILURE);
+        }
+        make_nonblocking(connections[i].fd);
+        connections[i].capacity = 64;
+        if (NULL == (connections[i].sent_at = malloc(connections[i].capacity * sizeof(uint64_t))))
+            ERR("malloc");
+        fds[i].fd = connections[i].fd;
+    }
+
+    uint64_t start = now_ns(), end = start + args->duration_ns, next_send = start;
+    int next_connection = 0;
+
+    // Closed loop: fill every connection up to the configured depth
+    if (0 == args->rate)
+        for (int i = 0; i < args->connections; i++)
+        {
+            for (int j = 0; j < args->depth; j++)
+                push_sent(&connections[i], start);
+            connections[i].owed = args->depth;
+        }
+
+    for (uint64_t now = start; now < end; now = now_ns())
+    {
+        // Open loop: schedule every request that is due, round robin over the connections
+        if (args->rate > 0)
+        {
+            while (next_send <= now)
+            {
+                lg_connection_t *connection = &connections[next_connection];
+                next_connection = (next_connection + 1) % args->connections;
+                push_sent(connection, next_send);
+                connection->owed++;
+                next_send += next_gap_ns(args->rate, &args->seed);
+            }
+        }
+
+        for (int i = 0; i < args->connections; i++)
+        {
+            fill_requests(&connections[i], &args->seed);
+            if (connections[i].out_length > 0)
+                flush_requests(args, &connections[i]);
+            fds[i].events = POLLIN | (connections[i].out_length > 0 ? POLLOUT : 0);
+        }
+
+        // Wait for replies, but not past the next scheduled request or the end of the run
+        uint64_t wake = args->rate > 0 && next_send < end ? next_send : end;
+        struct timespec timeout = {0, 0};
+        if (wake > now)
+        {
+            timeout.tv_sec = (wake - now) / 1000000000ull;
+            timeout.tv_nsec = (wake - now) % 1000000000ull;
+        }
+        if (ppoll(fds, args->connections, &timeout, NULL) < 0 && EINTR != errno)
+            ERR("ppoll");
+
+        now = now_ns();
+        for (int i = 0; i < args->connections; i++)
+        {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            int replies = read_replies(args, &connections[i], now);
+            // Closed loop: replace every answered request with a new one
+            if (0 == args->rate)
+            {
+                for (int j = 0; j < replies; j++)
+                    push_sent(&connections[i], now);
+                connections[i].owed += replies;
+            }
+        }
+    }
+
+    for (int i = 0; i < args->connections; i++)
+    {
+        if (TEMP_FAILURE_RETRY(close(connections[i].fd)) < 0)
+            ERR("close");
+        free(connections[i].sent_at);
+    }
+    free(connections);
+    free(fds);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int n_threads = 1, connections = 1, depth = 1, seconds = 10, version = PROTOCOL_V2, opt;
+    double rate = 0;
+    while ((opt = getopt(argc, argv, "t:c:d:r:s:p:")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                if ((n_threads = atoi(optarg)) < 1 || n_threads > MAX_THREADS)
+                    usage(argv[0]);
+                break;
+            case 'c':
+                if ((connections = atoi(optarg)) < 1 || connections > MAX_CONNECTIONS)
+                    usage(argv[0]);
+                break;
+            case 'd':
+                if ((depth = atoi(optarg)) < 1 || depth > (int)(OUT_BUFFER_SIZE / FRAME_SIZE))
+                    usage(argv[0]);
+                break;
+            case 'r':
+                if ((rate = atof(optarg)) <= 0)
+                    usage(argv[0]);
+                break;
+            case 's':
+                if ((seconds = atoi(optarg)) < 1)
+                    usage(argv[0]);
+                break;
+            case 'p':
+                if ((version = atoi(optarg)) != PROTOCOL_V1 && version != PROTOCOL_V2)
+                    usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1 && argc - optind != 2)
+        usage(argv[0]);
+
+    sethandler(SIG_IGN, SIGPIPE); // Ignore SIGPIPE
+
+    lg_thread_t *threads = calloc(n_threads, sizeof(lg_thread_t));
+    if (NULL == threads)
+        ERR("calloc");
+    for (int i = 0; i < n_threads; i++)
+    {
+        threads[i].address = argv[optind];
+        threads[i].port = argc - optind == 2 ? argv[optind + 1] : NULL;
+        threads[i].connections = connections;
+        threads[i].depth = depth;
+        threads[i].version = version;
+        threads[i].rate = rate / n_threads;
+        threads[i].duration_ns = (uint64_t)seconds * 1000000000ull;
+        threads[i].seed = getpid() ^ (i * 2654435761u);
+        histogram_init(&threads[i].latency);
+        if (pthread_create(&threads[i].thread, NULL, thread_work, &threads[i]))
+            ERR("pthread_create");
+    }
+
+    // Merge the results of the threads
+    histogram_t latency;
+    histogram_init(&latency);
+    uint64_t completed = 0, errors = 0, bytes_sent = 0, bytes_received = 0;
+    for (int i = 0; i < n_threads; i++)
+    {
+        if (pthread_join(threads[i].thread, NULL))
+            ERR("pthread_join");
+        histogram_merge(&latency, &threads[i].latency);
+        completed += threads[i].completed;
+        errors += threads[i].errors;
+        bytes_sent += threads[i].bytes_sent;
+        bytes_received += threads[i].bytes_received;
+    }
+    free(threads);
+
+    if (rate > 0)
+        printf("Mode: open loop, %.0f requests/s offered, %d thread(s) x %d connection(s)\n", rate, n_threads,
+               connections);
+    else
+        printf("Mode: closed loop, %d thread(s) x %d connection(s) x %d in flight\n", n_threads, connections, depth);
+    printf("Completed: %" PRIu64 " requests in %d s (%" PRIu64 " errors)\n", completed, seconds, errors);
+    printf("Throughput: %.0f requests/s\n", (double)completed / seconds);
+    if (completed > 0)
+        printf("Wire (bytes/request): sent %.1f, received %.1f\n", (double)bytes_sent / completed,
+               (double)bytes_received / completed);
+    printf("Latency (us): mean %.1f, p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n", histogram_mean(&latency) / 1e3,
+           histogram_quantile(&latency, 0.5) / 1e3, histogram_quantile(&latency, 0.99) / 1e3,
+           histogram_quantile(&latency, 0.999) / 1e3, latency.max / 1e3);
+    return EXIT_SUCCESS;
+}
@@ -11,4 +11,49 @@
 #define OPERATION_INDEX 3
 #define STATUS_INDEX 4
 
+#define MESSAGE_SIZE 5
+
+/*
+ * Batch frame: a regular frame with OPERATION_BATCH as the operation and the number of operations (1-BATCH_MAX)
+ * as the first operand, followed by the packed arrays of first operands, second operands and operations.
+ * The reply is the same header followed by the array of results and the array of statuses.
+ */
+#define OPERATION_BATCH 'B'
+#define BATCH_MAX 256
+#define BATCH_REQUEST_SIZE(count) (sizeof(int32_t) * (MESSAGE_SIZE + 3 * (size_t)(count)))
+#define BATCH_REPLY_SIZE(count) (sizeof(int32_t) * (MESSAGE_SIZE + 2 * (size_t)(count)))
+
+/*
+ * Expression frame: a regular frame with OPERATION_EXPRESSION as the operation, the number of operand tuples
+ * (1-EXPRESSION_MAX_TUPLES) as the first operand, the length of the expression in bytes (1-EXPRESSION_MAX_LENGTH)
+ * as the second operand and the number of variables of a tuple (1-EXPRESSION_MAX_VARIABLES) in the result slot,
+ * followed by the infix expression (padded with zeros to a multiple of 4 bytes) and the tuples, one after another.
+ * The expression names the variables of a tuple a, b, c, ... and may use non-negative integer constants,
+ * + - * /, unary minus and parentheses, e.g. "(a+b)*c/d". The whole request may not be larger than the largest
+ * batch request. The reply is laid out like the reply of a batch; its header status (and every tuple status) is -1
+ * if the expression does not compile or uses more variables than the tuples have.
+ */
+#define OPERATION_EXPRESSION 'E'
+#define EXPRESSION_MAX_LENGTH 256
+#define EXPRESSION_MAX_VARIABLES 26
+#define EXPRESSION_MAX_TUPLES BATCH_MAX
+#define EXPRESSION_REQUEST_SIZE(length, variables, count) \
+    (sizeof(int32_t) * (MESSAGE_SIZE + ((size_t)(length) + 3) / 4 + (size_t)(variables) * (size_t)(count)))
+#define EXPRESSION_REPLY_SIZE(count) BATCH_REPLY_SIZE(count)
+
+/*
+ * Shared-memory negotiation: a frame with OPERATION_SHM as the operation sent over a local stream connection
+ * asks the server to carry the following requests through shared-memory rings (see shm-ring.h). The server
+ * answers with the same frame, status 0 and the number of ring slots as the result, together with the file
+ * descriptors of the rings; or with status -1 if it does not offer them.
+ */
+#define OPERATION_SHM 'M'
+
+/*
+ * Protocol negotiation: a frame with OPERATION_VERSION as the operation and the wanted protocol version as the
+ * first operand. The server answers with the same frame, status 0 and the version it agreed on as the result, and
+ * reads the rest of the stream in that version (see protocol.h); servers without the negotiation answer status -1.
+ */
+#define OPERATION_VERSION 'V'
+
 #endif //SOCKETS_MACROS_H
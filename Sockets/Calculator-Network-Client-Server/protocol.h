@@ -0,0 +1,142 @@
+//
+// Compact wire protocol (version 2) of the calculator server.
+//
+// Version 1 frames are five int32_t words in network byte order, whatever the operands: 20 bytes per request and
+// 20 per reply. A client switches its stream connection to version 2 with a version 1 frame carrying
+// OPERATION_VERSION (see macros.h); every request and reply after it is encoded as
+//
+//   request: operation (1 byte), operand 1, operand 2 (64-bit integers, zigzag varints)
+//   reply:   status (1 byte, 0 or 0xff for -1), result (64-bit integer, zigzag varint)
+//
+// Varints carry 7 bits per byte, least significant group first, the high bit telling that another byte follows;
+// zigzag interleaves the signs (0, -1, 1, -2, ...) so small negative numbers stay short too. A request of small
+// operands takes 3 bytes and its reply 2. Batches, datagrams and shared-memory rings keep the version 1 frames.
+//
+
+#ifndef SOCKETS_PROTOCOL_H
+#define SOCKETS_PROTOCOL_H
+
+#include "socklib.h"
+#include "macros.h"
+
+#define PROTOCOL_V1 1
+#define PROTOCOL_V2 2
+#define VARINT_MAX 10 // Bytes of the longest 64-bit varint
+#define V2_REQUEST_MAX (1 + 2 * VARINT_MAX)
+#define V2_REPLY_MAX (1 + VARINT_MAX)
+
+/// @brief Encode a zigzag varint
+/// @param buffer Output, at least VARINT_MAX bytes
+/// @param value Value
+/// @return Number of bytes written
+size_t varint_encode(uint8_t *buffer, int64_t value)
+{
+    uint64_t zigzag = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+    size_t size = 0;
+    while (zigzag >= 0x80)
+    {
+        buffer[size++] = (uint8_t)zigzag | 0x80;
+        zigzag >>= 7;
+    }
+    buffer[size++] = (uint8_t)zigzag;
+    return size;
+}
+
+/// @brief Decode a zigzag varint
+/// @param buffer Input
+/// @param length Number of bytes available
+/// @param value Set to the value
+/// @return Number of bytes read, 0 if the varint is not complete yet, -1 if it is longer than VARINT_MAX
+int varint_decode(const uint8_t *buffer, size_t length, int64_t *value)
+{
+    uint64_t zigzag = 0;
+    for (size_t i = 0; i < length && i < VARINT_MAX; i++)
+    {
+        zigzag |= (uint64_t)(buffer[i] & 0x7f) << (7 * i);
+        if (!(buffer[i] & 0x80))
+        {
+            *value = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+            return i + 1;
+        }
+    }
+    return length < VARINT_MAX ? 0 : -1;
+}
+
+/// @brief Encode a version 2 request
+/// @param buffer Output, at least V2_REQUEST_MAX bytes
+/// @return Size of the request
+size_t v2_encode_request(uint8_t *buffer, char operation, int64_t operand1, int64_t operand2)
+{
+    buffer[0] = (uint8_t)operation;
+    size_t size = 1 + varint_encode(buffer + 1, operand1);
+    return size + varint_encode(buffer + size, operand2);
+}
+
+/// @brief Decode a version 2 request
+/// @param buffer Input
+/// @param length Number of bytes available
+/// @return Size of the request, 0 if it is not complete yet, -1 if it is malformed
+int v2_decode_request(const uint8_t *buffer, size_t length, char *operation, int64_t *operand1, int64_t *operand2)
+{
+    if (length < 1)
+        return 0;
+    int size1 = varint_decode(buffer + 1, length - 1, operand1);
+    if (size1 <= 0)
+        return size1;
+    int size2 = varint_decode(buffer + 1 + size1, length - 1 - size1, operand2);
+    if (size2 <= 0)
+        return size2;
+    *operation = (char)buffer[0];
+    return 1 + size1 + size2;
+}
+
+/// @brief Encode a version 2 reply
+/// @param buffer Output, at least V2_REPLY_MAX bytes
+/// @param status 0 or -1
+/// @param result Result
+/// @return Size of the reply
+size_t v2_encode_reply(uint8_t *buffer, int32_t status, int64_t result)
+{
+    buffer[0] = (uint8_t)status;
+    return 1 + varint_encode(buffer + 1, result);
+}
+
+/// @brief Decode a version 2 reply
+/// @param buffer Input
+/// @param length Number of bytes available
+/// @return Size of the reply, 0 if it is not complete yet, -1 if it is malformed
+int v2_decode_reply(const uint8_t *buffer, size_t length, int32_t *status, int64_t *result)
+{
+    if (length < 1)
+        return 0;
+    int size = varint_decode(buffer + 1, length - 1, result);
+    if (size <= 0)
+        return size;
+    *status = (int8_t)buffer[0];
+    return 1 + size;
+}
+
+/// @brief Ask the server to switch a blocking stream connection to another protocol version
+/// @param fd Connected socket, nothing may be in flight on it
+/// @param version Version wanted
+/// @return Version agreed on (PROTOCOL_V1 if the server does not know the negotiation), -1 if the connection broke
+int protocol_negotiate(int fd, int version)
+{
+    int32_t frame[MESSAGE_SIZE] = {0};
+    frame[OPERAND1_INDEX] = htonl(version);
+    frame[OPERATION_INDEX] = htonl(OPERATION_VERSION);
+    if (bulk_write(fd, (char *)frame, sizeof(frame)) < 0)
+    {
+        if (EPIPE == errno || ECONNRESET == errno)
+            return -1;
+        ERR("write");
+    }
+    ssize_t c = bulk_read(fd, (char *)frame, sizeof(frame));
+    if (c < 0 && ECONNRESET != errno)
+        ERR("read");
+    if (c != sizeof(frame))
+        return -1;
+    return 0 == frame[STATUS_INDEX] ? (int)ntohl(frame[RESULT_INDEX]) : PROTOCOL_V1;
+}
+
+#endif // SOCKETS_PROTOCOL_H
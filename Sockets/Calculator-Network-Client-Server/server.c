@@ -3,60 +3,754 @@
 //
 #include "socklib.h"
 #include "macros.h"
+#include "connection.h"
+#include "calculator.h"
+#include "uring.h"
+#include "worker-pool.h"
+#include "datagram.h"
+#include "stats.h"
+#include "expression.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
 
-#define MESSAGE_SIZE 5
 #define MAX_EVENTS 100
+#define MAX_REACTORS 64
+#define URING_ENTRIES 256
+#define URING_CONNECTIONS 256 // Per reactor, their buffers are registered with the ring
+#define MAX_WORKERS 256
+#define POOL_QUEUE_SIZE 4096
+#define DEFAULT_ACCEPT_BUDGET 64
+#define DRAIN_TIMEOUT_MS 30000 // Time a server that handed its listeners over waits for its clients to leave
 
-volatile sig_atomic_t do_work = 1;
+typedef enum
+{
+    BACKEND_EPOLL,
+    BACKEND_URING,
+} backend_t;
 
-void sigint_handler(int sig)
+/// @brief State of one reactor thread, each runs its own epoll loop
+typedef struct
 {
-    do_work = 0;
-}
+    pthread_t thread;
+    int id;
+    int tcp_socket_fd;   // Own SO_REUSEPORT listener
+    int local_socket_fd; // Shared between all reactors
+    int shutdown_fd;     // Shared eventfd, becomes readable when the server should stop
+    int drain_fd;        // Shared eventfd, becomes readable when another server took over the listeners
+    int udp_socket_fd;   // Own SO_REUSEPORT datagram socket
+    int dgram_socket_fd; // Local datagram socket shared between all reactors, -1 if disabled
+    datagram_batch_t *datagrams;
+    server_stats_t *stats;
+    backend_t backend;
+    completion_queue_t completions; // Requests of this reactor returned by the worker pool
+    int accept_budget;              // Connections accepted at most per wakeup
+    trace_ring_t *trace;            // Ring capturing the requests of this reactor, NULL if not capturing
+} reactor_t;
 
 void usage(char *name)
 {
-    fprintf(stderr, "Usage: %s <local socket name> <port number>\n", name);
-    fprintf(stderr, "  port number: 1-65535\n");
+    fprintf(stderr, "Usage: %s [-j reactors] [-b epoll|uring] [-w workers] [-a budget] [-d datagram socket name] [-s admin socket name] [-i idle timeout] [-u handoff socket name] [-c capture file] <local socket name> <port number>\n", name);
+    fprintf(stderr, "  reactors: number of event loop threads, 1-%d (default 1)\n", MAX_REACTORS);
+    fprintf(stderr, "  -b: event backend, epoll with read/write calls (default) or io_uring\n");
+    fprintf(stderr, "  -a: connections accepted at most per wakeup of a reactor (default %d)\n", DEFAULT_ACCEPT_BUDGET);
+    fprintf(stderr, "  -w: number of worker threads computing the requests off the epoll reactors, 1-%d (default: none)\n", MAX_WORKERS);
+    fprintf(stderr, "  -d: also serve requests sent as datagrams to a local socket with this name\n");
+    fprintf(stderr, "  -i: close connections without any activity for this many seconds (default: never)\n");
+    fprintf(stderr, "  -u: hand the listeners over to a new server started with the same -u, which takes them from\n"
+                    "      the running one instead of binding them, and lets it finish its connections\n");
+    fprintf(stderr, "  -c: capture every request to this file, to be replayed by trace-replay\n");
+    fprintf(stderr, "  -s: print the counters and latency histograms of the reactors to every client of this local socket\n");
+    fprintf(stderr, "  port number: 1-65535, for both TCP connections and UDP datagrams\n");
     exit(EXIT_FAILURE);
 }
 
+batch_kernel_t calculate_batch;
+worker_pool_t *worker_pool; // NULL if the reactors compute the requests themselves
+
+/// @brief Size of the request starting with the given header
+/// @param data Header of the request (network byte order)
+/// @return Size of the request in bytes, 0 if the header is malformed
+size_t request_size(const int32_t *data)
+{
+    int32_t count = ntohl(data[OPERAND1_INDEX]);
+    if (OPERATION_EXPRESSION == (char)ntohl(data[OPERATION_INDEX]))
+    {
+        int32_t length = ntohl(data[OPERAND2_INDEX]), variables = ntohl(data[RESULT_INDEX]);
+        if (count < 1 || count > EXPRESSION_MAX_TUPLES || length < 1 || length > EXPRESSION_MAX_LENGTH ||
+            variables < 1 || variables > EXPRESSION_MAX_VARIABLES)
+            return 0;
+        // Expressions share the buffers sized for the largest batch
+        size_t size = EXPRESSION_REQUEST_SIZE(length, variables, count);
+        return size <= BATCH_REQUEST_SIZE(BATCH_MAX) ? size : 0;
+    }
+    if (OPERATION_BATCH != (char)ntohl(data[OPERATION_INDEX]))
+        return sizeof(int32_t[MESSAGE_SIZE]);
+    if (count < 1 || count > BATCH_MAX)
+        return 0;
+    return BATCH_REQUEST_SIZE(count);
+}
+
+/// @brief Size of the reply to a request
+/// @param data Header of a request that request_size accepted (network byte order)
+/// @return Size of the reply in bytes, the reply of an expression on few variables may be larger than its request
+size_t reply_size(const int32_t *data)
+{
+    char operation = (char)ntohl(data[OPERATION_INDEX]);
+    if (OPERATION_BATCH == operation || OPERATION_EXPRESSION == operation)
+        return BATCH_REPLY_SIZE(ntohl(data[OPERAND1_INDEX]));
+    return sizeof(int32_t[MESSAGE_SIZE]);
+}
+
 /// @brief Perform a calculation based on the data received from the client and store it in the data array,
-/// converting the data to host byte order and back to network byte order
-/// @param data Data received from the client
-void perform_calculation(int32_t* data)
+/// converting the data to host byte order and back to network byte order.
+/// A batch request is evaluated with the vectorized batch kernel and turned into its reply in place,
+/// an expression request with its cached plan.
+/// @param data Data received from the client (a complete request, see request_size), with room for its reply
+/// @return Size of the reply at the beginning of data in bytes
+size_t perform_calculation(int32_t* data)
 {
     // Convert the data to host byte order
     for(int i = 0; i < 5; i++) data[i] = ntohl(data[i]);
 
     // Perform the calculation
-    switch((char)data[OPERATION_INDEX]){
-        case '+':
-            data[RESULT_INDEX] = data[OPERAND1_INDEX] + data[OPERAND2_INDEX];
+    size_t reply_size = sizeof(int32_t[MESSAGE_SIZE]);
+    if (OPERATION_BATCH == (char)data[OPERATION_INDEX]) {
+        int32_t count = data[OPERAND1_INDEX];
+        // The results replace the first operands and the statuses the second ones, which is the layout of the reply
+        calculate_batch(count, data + MESSAGE_SIZE, data + MESSAGE_SIZE + count, data + MESSAGE_SIZE + 2 * count);
+        data[STATUS_INDEX] = 0;
+        reply_size = BATCH_REPLY_SIZE(count);
+    } else if (OPERATION_EXPRESSION == (char)data[OPERATION_INDEX]) {
+        int32_t count = data[OPERAND1_INDEX], length = data[OPERAND2_INDEX], variables = data[RESULT_INDEX];
+        const int32_t *tuples = data + MESSAGE_SIZE + (length + 3) / 4;
+        data[STATUS_INDEX] = expression_evaluate((const char *)(data + MESSAGE_SIZE), length, variables, count, tuples,
+                                                 data + MESSAGE_SIZE, data + MESSAGE_SIZE + count);
+        data[RESULT_INDEX] = 0;
+        reply_size = EXPRESSION_REPLY_SIZE(count);
+    } else {
+        data[RESULT_INDEX] = calculate((char)data[OPERATION_INDEX], data[OPERAND1_INDEX], data[OPERAND2_INDEX], &data[STATUS_INDEX]);
+    }
+
+    // Convert the data back to network byte order
+    for(int i = 0; i < 5; i++) data[i] = htonl(data[i]);
+    return reply_size;
+}
+
+/// @brief Answer a request whose header cannot be framed with status -1 and stop reading from the connection,
+/// since the rest of its stream cannot be framed either
+/// @param connection Connection state
+/// @param data Header of the request
+/// @return 0 on success, -1 if the reply does not fit into the write buffer yet
+int reject_request(connection_t *connection, int32_t *data)
+{
+    if (connection_write_space(connection) < sizeof(int32_t[MESSAGE_SIZE]))
+        return -1;
+    stats_count(STAT_MALFORMED, 1);
+    data[STATUS_INDEX] = htonl(-1);
+    memcpy(connection->write_buffer + connection->write_length, data, sizeof(int32_t[MESSAGE_SIZE]));
+    connection->write_length += sizeof(int32_t[MESSAGE_SIZE]);
+    connection->state = CONNECTION_CLOSING;
+    connection->read_length = 0;
+    return 0;
+}
+
+/// @brief Perform the calculation of a version 2 request and replace it with its reply
+/// @param data A complete and well-formed request (see v2_decode_request)
+/// @return Size of the reply at the beginning of data in bytes, never more than the size of the request
+size_t perform_calculation_v2(uint8_t *data)
+{
+    char operation;
+    int64_t operand1, operand2;
+    int32_t status = 0;
+    v2_decode_request(data, V2_REQUEST_MAX, &operation, &operand1, &operand2);
+    int64_t result = calculate64(operation, operand1, operand2, &status);
+    return v2_encode_reply(data, status, result);
+}
+
+/// @brief Answer a version 2 request that cannot be framed (a varint of more than 64 bits), see reject_request
+/// @return 0 on success, -1 if the reply does not fit into the write buffer yet
+int reject_request_v2(connection_t *connection)
+{
+    if (connection_write_space(connection) < V2_REPLY_MAX)
+        return -1;
+    stats_count(STAT_MALFORMED, 1);
+    connection->write_length += v2_encode_reply((uint8_t *)connection->write_buffer + connection->write_length, -1, 0);
+    connection->state = CONNECTION_CLOSING;
+    connection->read_length = 0;
+    return 0;
+}
+
+/// @brief Answer a protocol negotiation and switch the connection to the agreed version,
+/// every request before it must be answered already
+/// @param connection Connection state
+/// @param data Negotiation frame (network byte order), turned into its reply
+/// @return 0 on success, -1 if the reply does not fit into the write buffer yet
+int negotiate_version(connection_t *connection, int32_t *data)
+{
+    if (connection_write_space(connection) < sizeof(int32_t[MESSAGE_SIZE]))
+        return -1;
+    int32_t version = ntohl(data[OPERAND1_INDEX]);
+    if (version >= PROTOCOL_V1)
+    {
+        connection->version = version < PROTOCOL_V2 ? version : PROTOCOL_V2;
+        data[RESULT_INDEX] = htonl(connection->version);
+        data[STATUS_INDEX] = 0;
+    }
+    else
+        data[STATUS_INDEX] = htonl(-1);
+    memcpy(connection->write_buffer + connection->write_length, data, sizeof(int32_t[MESSAGE_SIZE]));
+    connection->write_length += sizeof(int32_t[MESSAGE_SIZE]);
+    return 0;
+}
+
+/// @brief Compute a request handed to the worker pool
+/// @param job Pending request
+void perform_job(pool_job_t *job)
+{
+    pending_request_t *pending = (pending_request_t *) job;
+    uint64_t start = stats_clock();
+    if (PROTOCOL_V2 == pending->version)
+        pending->size = perform_calculation_v2((uint8_t *)pending->data);
+    else
+        pending->size = perform_calculation(pending->data);
+    pending->compute_ns = stats_clock() - start;
+}
+
+/// @brief Move the replies of the finished requests at the head of the pipeline into the write buffer
+/// @param connection Connection state
+void collect_replies(connection_t *connection)
+{
+    while (connection->pending_head != connection->pending_tail)
+    {
+        pending_request_t *pending = &connection->pending[connection->pending_head % CONNECTION_PIPELINE];
+        if (!pending->done || connection_write_space(connection) < pending->size)
             break;
-        case '-':
-            data[RESULT_INDEX] = data[OPERAND1_INDEX] - data[OPERAND2_INDEX];
+        memcpy(connection->write_buffer + connection->write_length, pending->data, pending->size);
+        connection->write_length += pending->size;
+        histogram_record(&thread_stats->histograms[STAT_COMPUTE], pending->compute_ns);
+        if (pending->data != pending->frame)
+            free(pending->data);
+        connection->pending_head++;
+    }
+}
+
+/// @brief Copy a complete request of the read buffer to the next slot of the pipeline of the connection
+/// @param connection Connection state
+/// @param request Request in the read buffer
+/// @param size Size of the request
+/// @param capacity Size of the buffer of the request, at least the size of its reply
+/// @return Pending request, to be counted and submitted
+pending_request_t *queue_request(connection_t *connection, const char *request, size_t size, size_t capacity)
+{
+    pending_request_t *pending = &connection->pending[connection->pending_tail++ % CONNECTION_PIPELINE];
+    pending->job.completions = connection->completions;
+    pending->connection = connection;
+    pending->done = 0;
+    pending->version = connection->version;
+    pending->size = size;
+    if (capacity <= sizeof(pending->frame))
+        pending->data = pending->frame;
+    else if (NULL == (pending->data = malloc(capacity)))
+        ERR("malloc");
+    memcpy(pending->data, request, size);
+    return pending;
+}
+
+/// @brief Hand a queued request to the worker pool, or compute it here if the pool is saturated
+void submit_request(connection_t *connection, pending_request_t *pending)
+{
+    if (worker_pool_submit(worker_pool, &pending->job) < 0)
+    {
+        perform_job(&pending->job);
+        pending->done = 1;
+    }
+    else
+        connection->in_flight++;
+}
+
+/// @brief Hand every complete version 2 request waiting in the read buffer to the worker pool, see dispatch_requests
+/// @param connection Connection state
+void dispatch_requests_v2(connection_t *connection)
+{
+    size_t offset = 0;
+    while (offset < connection->read_length &&
+           connection->pending_tail - connection->pending_head < CONNECTION_PIPELINE)
+    {
+        char operation;
+        int64_t operand1, operand2;
+        int size = v2_decode_request((uint8_t *)connection->read_buffer + offset, connection->read_length - offset,
+                                     &operation, &operand1, &operand2);
+        if (size < 0)
+        {
+            // The rejection is answered after every request before it
+            if (connection->pending_head == connection->pending_tail && 0 == reject_request_v2(connection))
+                return;
             break;
-        case '*':
-            data[RESULT_INDEX] = data[OPERAND1_INDEX] * data[OPERAND2_INDEX];
+        }
+        if (0 == size)
             break;
-        case '/':
-            if(data[OPERAND2_INDEX] == 0){
-                data[STATUS_INDEX] = -1;
-            } else {
-                data[RESULT_INDEX] = data[OPERAND1_INDEX] / data[OPERAND2_INDEX];
-            }
+        stats_count_operation(operation, operand2);
+        connection_trace(connection, connection->read_buffer + offset, size);
+        submit_request(connection, queue_request(connection, connection->read_buffer + offset, size, size));
+        offset += size;
+    }
+    connection_consume(connection, offset);
+    collect_replies(connection);
+}
+
+/// @brief Hand every complete request waiting in the read buffer to the worker pool, as long as the pipeline
+/// of the connection has room, and collect the replies that are ready
+/// @param connection Connection state
+void dispatch_requests(connection_t *connection)
+{
+    int32_t header[MESSAGE_SIZE];
+    size_t offset = 0, size;
+    collect_replies(connection);
+    if (PROTOCOL_V2 == connection->version)
+    {
+        dispatch_requests_v2(connection);
+        return;
+    }
+    while (connection->read_length - offset >= sizeof(header) &&
+           connection->pending_tail - connection->pending_head < CONNECTION_PIPELINE)
+    {
+        memcpy(header, connection->read_buffer + offset, sizeof(header));
+        if (0 == (size = request_size(header)))
+        {
+            // The rejection is answered after every request before it
+            if (connection->pending_head == connection->pending_tail && 0 == reject_request(connection, header))
+                return;
+            break;
+        }
+        if (connection->read_length - offset < size)
+            break;
+        if (OPERATION_VERSION == (char)ntohl(header[OPERATION_INDEX]))
+        {
+            // Answered after every request before it, the rest of the buffer is in the agreed version
+            if (connection->pending_head != connection->pending_tail || negotiate_version(connection, header) < 0)
+                break;
+            connection_trace(connection, connection->read_buffer + offset, size);
+            offset += size;
+            if (PROTOCOL_V1 != connection->version)
+                break;
+            continue;
+        }
+
+        size_t capacity = size > reply_size(header) ? size : reply_size(header);
+        connection_trace(connection, connection->read_buffer + offset, size);
+        pending_request_t *pending = queue_request(connection, connection->read_buffer + offset, size, capacity);
+        offset += size;
+        stats_count_request(pending->data);
+        submit_request(connection, pending);
+    }
+
+    // Whatever is left is a partial frame (or requests waiting for room in the pipeline)
+    connection_consume(connection, offset);
+    if (PROTOCOL_V2 == connection->version)
+        dispatch_requests_v2(connection);
+    else
+        collect_replies(connection);
+}
+
+/// @brief Answer every complete version 2 request waiting in the read buffer, see process_requests
+/// @param connection Connection state
+void process_requests_v2(connection_t *connection)
+{
+    uint8_t data[V2_REQUEST_MAX];
+    size_t offset = 0;
+    uint64_t start = stats_clock();
+    while (offset < connection->read_length)
+    {
+        char operation;
+        int64_t operand1, operand2;
+        int size = v2_decode_request((uint8_t *)connection->read_buffer + offset, connection->read_length - offset,
+                                     &operation, &operand1, &operand2);
+        if (size < 0)
+        {
+            if (0 == reject_request_v2(connection))
+                return;
+            break;
+        }
+        // The reply is never larger than the request
+        if (0 == size || connection_write_space(connection) < (size_t)size)
             break;
-        default:
-            data[STATUS_INDEX] = -1;
+        memcpy(data, connection->read_buffer + offset, size);
+        offset += size;
+        connection_trace(connection, data, size);
+
+        stats_count_operation(operation, operand2);
+        size = perform_calculation_v2(data);
+        memcpy(connection->write_buffer + connection->write_length, data, size);
+        connection->write_length += size;
     }
 
-    // Convert the data back to network byte order
-    for(int i = 0; i < 5; i++) data[i] = htonl(data[i]);
+    connection_consume(connection, offset);
+    if (offset > 0)
+        stats_record(STAT_COMPUTE, start);
+}
+
+/// @brief Answer every complete request waiting in the read buffer, as long as the replies fit into the write buffer
+/// @param connection Connection state
+void process_requests(connection_t *connection)
+{
+    if (connection->completions)
+    {
+        dispatch_requests(connection);
+        return;
+    }
+    if (PROTOCOL_V2 == connection->version)
+    {
+        process_requests_v2(connection);
+        return;
+    }
+
+    int32_t data[MESSAGE_SIZE + 3 * BATCH_MAX];
+    size_t offset = 0, size;
+    uint64_t start = stats_clock();
+    while (connection->read_length - offset >= sizeof(int32_t[MESSAGE_SIZE]))
+    {
+        memcpy(data, connection->read_buffer + offset, sizeof(int32_t[MESSAGE_SIZE]));
+        if (0 == (size = request_size(data)))
+        {
+            if (0 == reject_request(connection, data))
+                return;
+            break;
+        }
+        if (connection->read_length - offset < size || connection_write_space(connection) < reply_size(data))
+            break;
+        memcpy(data, connection->read_buffer + offset, size);
+        offset += size;
+        connection_trace(connection, data, size);
+        if (OPERATION_VERSION == (char)ntohl(data[OPERATION_INDEX]))
+        {
+            negotiate_version(connection, data);
+            // The rest of the buffer is in the agreed version
+            if (PROTOCOL_V1 != connection->version)
+                break;
+            continue;
+        }
+
+        stats_count_request(data);
+        size = perform_calculation(data);
+#ifdef DEBUG
+        fprintf(stderr, "Operand1: %d, Operand2: %d, Result: %d, Operation: %c, Status: %d\n",
+                ntohl(data[OPERAND1_INDEX]), ntohl(data[OPERAND2_INDEX]), ntohl(data[RESULT_INDEX]), (char)ntohl(data[OPERATION_INDEX]), ntohl(data[STATUS_INDEX]));
+#endif
+        memcpy(connection->write_buffer + connection->write_length, data, size);
+        connection->write_length += size;
+    }
+
+    // Whatever is left is a partial frame (or requests waiting for space in the write buffer)
+    connection_consume(connection, offset);
+    if (offset > 0)
+        stats_record(STAT_COMPUTE, start);
+    if (PROTOCOL_V2 == connection->version)
+        process_requests_v2(connection);
+}
+
+/// @brief Register an endpoint in the epoll instance
+/// @param epoll_fd Epoll instance
+/// @param endpoint Endpoint to watch for incoming data
+/// @param events Additional epoll flags
+void add_endpoint(int epoll_fd, endpoint_t *endpoint, uint32_t events)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | events;
+    ev.data.ptr = endpoint;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, endpoint->fd, &ev) < 0)
+        ERR("epoll_ctl");
+}
+
+/// @brief Stop watching an endpoint
+void remove_endpoint(int epoll_fd, endpoint_t *endpoint)
+{
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, endpoint->fd, NULL) < 0)
+        ERR("epoll_ctl");
+}
+
+/// @brief Switch a local connection to shared-memory rings if the request at the head of its read buffer asks
+/// for it, and nothing sent before is still unanswered
+/// @param epoll_fd Epoll instance
+/// @param connection Connection state
+void accept_shm_channel(int epoll_fd, connection_t *connection)
+{
+    int32_t frame[MESSAGE_SIZE];
+    if (!connection->local || connection->channel || PROTOCOL_V1 != connection->version ||
+        connection->read_length < sizeof(frame) ||
+        connection->write_length > 0 || connection->pending_head != connection->pending_tail)
+        return;
+    memcpy(frame, connection->read_buffer, sizeof(frame));
+    if (OPERATION_SHM != (char)ntohl(frame[OPERATION_INDEX]))
+        return;
+    connection_consume(connection, sizeof(frame));
+
+    shm_channel_t *channel = malloc(sizeof(shm_channel_t));
+    if (NULL == channel)
+        ERR("malloc");
+    int memory_fd;
+    channel->endpoint.type = ENDPOINT_SHM_CHANNEL;
+    channel->connection = connection;
+    channel->region = shm_region_create(&memory_fd, &channel->endpoint.fd, &channel->reply_fd);
+    channel->epoll_fd = epoll_fd;
+    connection->channel = channel;
+
+    frame[RESULT_INDEX] = htonl(SHM_RING_SLOTS);
+    frame[STATUS_INDEX] = 0;
+    int fds[3] = {memory_fd, channel->endpoint.fd, channel->reply_fd};
+    int sent = send_fds(connection->endpoint.fd, frame, sizeof(frame), fds, 3);
+    if (TEMP_FAILURE_RETRY(close(memory_fd)) < 0)
+        ERR("close");
+    add_endpoint(epoll_fd, &channel->endpoint, 0);
+    if (sent < 0)
+        connection->state = CONNECTION_CLOSING; // The client is gone, or does not read what it asked for
+}
+
+/// @brief Answer the requests waiting in the shared-memory rings of a connection, until the ring is empty
+/// and the server announced that it sleeps
+/// @param channel Shared-memory rings
+void handle_shm_channel(shm_channel_t *channel)
+{
+    connection_t *connection = channel->connection;
+    // The connection was closed by an earlier event of the same batch
+    if (connection->endpoint.fd < 0)
+        return;
+    uint64_t count;
+    if (TEMP_FAILURE_RETRY(read(channel->endpoint.fd, &count, sizeof(count))) < 0 && EAGAIN != errno)
+        ERR("read");
+    connection_touch(connection);
+
+    shm_ring_t *requests = &channel->region->requests, *replies = &channel->region->replies;
+    int32_t frame[MESSAGE_SIZE];
+    uint64_t start = stats_clock();
+    do
+    {
+        int served = 0;
+        while (0 == shm_ring_pop(requests, frame))
+        {
+            connection_trace(connection, frame, sizeof(frame));
+            // Batches and expressions do not fit into the slots of the rings
+            if (sizeof(frame) != request_size(frame))
+            {
+                stats_count(STAT_MALFORMED, 1);
+                frame[STATUS_INDEX] = htonl(-1);
+            }
+            else
+            {
+                stats_count_request(frame);
+                perform_calculation(frame);
+            }
+            // A client keeps at most SHM_RING_SLOTS requests outstanding, so the replies always fit
+            if (shm_ring_push(replies, frame) < 0)
+            {
+                fprintf(stderr, "Shared-memory client overran its replies, closing it\n");
+                connection_destroy(connection);
+                return;
+            }
+            served++;
+        }
+        if (served > 0)
+            shm_ring_notify(replies, channel->reply_fd);
+    } while (shm_ring_prepare_sleep(requests) < 0);
+    stats_record(STAT_COMPUTE, start);
+}
+
+/// @brief Advance the state machine of a connection after epoll reported events on its socket
+/// @param epoll_fd Epoll instance
+/// @param connection Connection state (destroyed if the connection ends)
+/// @param events Events reported by epoll
+void handle_connection(int epoll_fd, connection_t *connection, uint32_t events)
+{
+    // The connection was closed by an earlier event of the same batch
+    if (connection->endpoint.fd < 0)
+        return;
+    if (events)
+        connection_touch(connection);
+
+    // Receive whatever the client sent, without waiting for the rest of a partial frame
+    if (CONNECTION_READING == connection->state && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+    {
+        uint64_t start = stats_clock();
+        int status = connection_fill(connection);
+        stats_record(STAT_READ, start);
+        if (status < 0)
+        {
+            connection_destroy(connection);
+            return;
+        }
+        if (0 == status)
+            connection->state = CONNECTION_CLOSING;
+        accept_shm_channel(epoll_fd, connection);
+    }
+
+    // Compute the replies and send as many of them as the socket accepts
+    process_requests(connection);
+    int flushed = 0;
+    if (connection->write_length > 0)
+    {
+        uint64_t start = stats_clock();
+        flushed = connection_flush(connection);
+        stats_record(STAT_WRITE, start);
+    }
+    if (flushed < 0)
+    {
+        connection_destroy(connection);
+        return;
+    }
+    process_requests(connection);
+
+    if (CONNECTION_CLOSING == connection->state)
+    {
+        // The client will not send anything more, close once every complete request was answered
+        if (connection->write_length > 0 || connection->pending_head != connection->pending_tail)
+        {
+            connection_update_events(epoll_fd, connection);
+            return;
+        }
+        if (connection->read_length > 0)
+            stats_count(STAT_PARTIAL_FRAMES, 1);
+        connection_destroy(connection);
+        return;
+    }
+
+    // Stop reading while the client does not collect its replies, so it cannot make us buffer without bound
+    if (CONNECTION_BUFFER_SIZE == connection->read_length || connection_write_space(connection) < sizeof(int32_t[MESSAGE_SIZE]))
+        connection->state = CONNECTION_WRITING;
+    else
+        connection->state = CONNECTION_READING;
+    connection_update_events(epoll_fd, connection);
+}
+
+/// @brief Accept the pending connections of the ready listeners and register them in the epoll instance.
+/// The listeners take turns, one connection each, until they are drained or the budget of the wakeup runs out;
+/// whatever is left stays in the backlog and wakes the (level-triggered) epoll instance again.
+/// @param epoll_fd Epoll instance
+/// @param reactor Reactor owning the connections
+/// @param listeners Listeners reported readable
+/// @param n_listeners Number of listeners
+void accept_connections(int epoll_fd, reactor_t *reactor, endpoint_t **listeners, int n_listeners)
+{
+    int budget = reactor->accept_budget;
+    while (n_listeners > 0)
+    {
+        for (int i = 0; i < n_listeners; i++)
+        {
+            if (0 == budget)
+            {
+                stats_count(STAT_ACCEPT_DEFERRED, 1);
+                return;
+            }
+            int client_fd = add_new_client(listeners[i]->fd);
+            if (client_fd < 0)
+            {
+                // Backlog drained, drop the listener from this round
+                listeners[i--] = listeners[--n_listeners];
+                continue;
+            }
+            budget--;
+            stats_count(STAT_ACCEPTED, 1);
+            connection_t *connection = connection_create(client_fd);
+            connection->local = listeners[i]->fd == reactor->local_socket_fd;
+            if (worker_pool)
+                connection_use_pool(connection, &reactor->completions);
+            connection_touch(connection);
+            connection_update_events(epoll_fd, connection);
+        }
+    }
+}
+
+/// @brief Take back the requests the worker pool finished and send their replies
+/// @param epoll_fd Epoll instance
+/// @param reactor Reactor
+void handle_completions(int epoll_fd, reactor_t *reactor)
+{
+    completion_queue_rearm(&reactor->completions);
+    pending_request_t *pending;
+    while (0 == mpmc_pop(&reactor->completions.queue, (void **)&pending))
+    {
+        connection_t *connection = pending->connection;
+        pending->done = 1;
+        connection->in_flight--;
+        handle_connection(epoll_fd, connection, 0);
+    }
+}
+
+/// @brief Answer the pending datagrams of a datagram socket, one batch per call.
+/// Whatever is left wakes the (level-triggered) epoll instance again, so connections are not starved.
+/// @param reactor Reactor
+/// @param fd Datagram socket
+void handle_datagrams(reactor_t *reactor, int fd)
+{
+    datagram_batch_t *batch = reactor->datagrams;
+    uint64_t start = stats_clock();
+    int count = datagram_receive(batch, fd);
+    start = stats_record(STAT_READ, start);
+    for (int i = 0; i < count; i++)
+    {
+        struct msghdr *message = &batch->messages[i].msg_hdr;
+        size_t length = batch->messages[i].msg_len;
+        int32_t *data = batch->buffers[i];
+        batch->iovecs[i].iov_len = 0;
+
+        // An unbound local client cannot be answered, neither can a datagram too short to carry a header
+        if (message->msg_namelen <= sizeof(sa_family_t) || length < sizeof(int32_t[MESSAGE_SIZE]))
+        {
+            stats_count(STAT_DATAGRAMS_DROPPED, 1);
+            continue;
+        }
+        if (message->msg_flags & MSG_TRUNC || length != request_size(data))
+        {
+            // Answer with the header and status -1, like a malformed request on a connection
+            stats_count(STAT_DATAGRAMS_DROPPED, 1);
+            stats_count(STAT_MALFORMED, 1);
+            data[STATUS_INDEX] = htonl(-1);
+            batch->iovecs[i].iov_len = sizeof(int32_t[MESSAGE_SIZE]);
+            continue;
+        }
+        trace_request(fd == reactor->dgram_socket_fd ? TRACE_LOCAL_DATAGRAM : TRACE_UDP, 0, data, length);
+        stats_count_request(data);
+        batch->iovecs[i].iov_len = perform_calculation(data);
+    }
+    if (0 == count)
+        return;
+    stats_count(STAT_DATAGRAMS_RECEIVED, count);
+    start = stats_record(STAT_COMPUTE, start);
+    stats_count(STAT_DATAGRAMS_DROPPED, datagram_send(batch, fd, count));
+    stats_record(STAT_WRITE, start);
+}
+
+/// @brief Close a connection whose idle timer fired, whatever state it is in: it neither sent requests nor
+/// collected replies for idle_timeout_ms, so it is idle or the client is gone without closing it
+/// @param timer Idle timer of the connection
+/// @param arg Unused
+void expire_idle_connection(wheel_timer_t *timer, void *arg)
+{
+    (void)arg;
+    connection_t *connection = (connection_t *)((char *)timer - offsetof(connection_t, idle_timer));
+    stats_count(STAT_IDLE_TIMEOUTS, 1);
+    connection_destroy(connection);
+}
+
+/// @brief Earlier of two epoll timeouts
+/// @return Timeout in milliseconds, -1 if both are infinite
+int min_timeout(int timeout1, int timeout2)
+{
+    if (timeout1 < 0)
+        return timeout2;
+    if (timeout2 < 0)
+        return timeout1;
+    return timeout1 < timeout2 ? timeout1 : timeout2;
 }
 
-int server_work(int tcp_socket_fd, int local_socket_fd)
+void *server_work(void *args)
 {
+    reactor_t *reactor = args;
+    thread_stats = reactor->stats;
+    thread_trace = reactor->trace;
+
     /*
      * Create an epoll instance and add the TCP and local sockets to it.
      */
@@ -66,133 +760,809 @@ int server_work(int tcp_socket_fd, int local_socket_fd)
     if (epoll_fd < 0)
         ERR("epoll_create");
 
-    // Add the TCP and local sockets to the epoll instance
-    struct epoll_event ev;
-    ev.events = EPOLLIN;
-    ev.data.fd = tcp_socket_fd;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, tcp_socket_fd, &ev) < 0)
-        ERR("epoll_ctl");
-    ev.data.fd = local_socket_fd;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, local_socket_fd, &ev) < 0)
-        ERR("epoll_ctl");
+    // Add the TCP and local sockets to the epoll instance, the local socket is shared by all the reactors,
+    // so it is registered as exclusive to wake up only one of them per incoming connection
+    endpoint_t tcp_listener = {ENDPOINT_LISTENER, reactor->tcp_socket_fd};
+    endpoint_t local_listener = {ENDPOINT_LISTENER, reactor->local_socket_fd};
+    endpoint_t shutdown = {ENDPOINT_SHUTDOWN, reactor->shutdown_fd};
+    endpoint_t drain = {ENDPOINT_DRAIN, reactor->drain_fd};
+    add_endpoint(epoll_fd, &tcp_listener, 0);
+    add_endpoint(epoll_fd, &local_listener, EPOLLEXCLUSIVE);
+    add_endpoint(epoll_fd, &shutdown, 0);
+    add_endpoint(epoll_fd, &drain, 0);
+
+    // Same for the datagram sockets
+    endpoint_t udp_socket = {ENDPOINT_DATAGRAM, reactor->udp_socket_fd};
+    endpoint_t dgram_socket = {ENDPOINT_DATAGRAM, reactor->dgram_socket_fd};
+    add_endpoint(epoll_fd, &udp_socket, 0);
+    if (reactor->dgram_socket_fd >= 0)
+        add_endpoint(epoll_fd, &dgram_socket, EPOLLEXCLUSIVE);
 
-    // Set up the maximum number of events and live connections
-    int N_LIVE_CONNECTIONS = 2;
+    // Watch for requests returned by the worker pool
+    endpoint_t completions = {ENDPOINT_COMPLETIONS, -1};
+    if (worker_pool)
+    {
+        completions.fd = reactor->completions.event_fd;
+        add_endpoint(epoll_fd, &completions, 0);
+    }
 
     // Create an array of epoll events
     struct epoll_event events[MAX_EVENTS];
 
-    // Create an array of data to be sent and received to/from the client
-    int32_t data[MESSAGE_SIZE];
-    ssize_t received_message_size;
-
-    // Create a sigmask for SIGINT
-    sigset_t sigmask, old_mask;
-    sigemptyset(&sigmask);
-    sigaddset(&sigmask, SIGINT);
-    sigprocmask(SIG_BLOCK, &sigmask, &old_mask);
+    // The idle timers bound how long epoll_wait may sleep
+    timer_wheel_t *wheel = NULL;
+    if (idle_timeout_ms > 0)
+    {
+        if (NULL == (wheel = malloc(sizeof(timer_wheel_t))))
+            ERR("malloc");
+        timer_wheel_init(wheel, stats_clock() / 1000000);
+        idle_timers = wheel;
+    }
 
     // Main server loop
+    int do_work = 1;
+    uint64_t drain_deadline_ms = 0; // Set once the listeners were handed over
     while(do_work){
         // Wait for events
 #ifdef DEBUG
-        fprintf(stderr, "Waiting for events\n");
+        fprintf(stderr, "[%d] Waiting for events\n", reactor->id);
 #endif
-        int nfds = epoll_pwait(epoll_fd, events, MAX_EVENTS, -1, &old_mask);
-        if (nfds < 0 && errno != EINTR)
+        uint64_t now_ms = stats_clock() / 1000000;
+        int timeout = wheel ? timer_wheel_timeout(wheel, now_ms) : -1;
+        if (drain_deadline_ms)
+            timeout = min_timeout(timeout, drain_deadline_ms > now_ms ? drain_deadline_ms - now_ms : 0);
+        int nfds = TEMP_FAILURE_RETRY(epoll_wait(epoll_fd, events, MAX_EVENTS, timeout));
+        if (nfds < 0)
             ERR("epoll_wait");
 
 #ifdef DEBUG
-        fprintf(stderr, "Received %d events\n", nfds);
+        fprintf(stderr, "[%d] Received %d events\n", reactor->id, nfds);
 #endif
 
+        endpoint_t *ready_listeners[2];
+        int n_ready_listeners = 0;
         for (int i = 0; i < nfds; i++)
         {
-            // Accept a new connection
-            int client_fd = add_new_client(events[i].data.fd);
-            if (client_fd < 0)
-                continue;
-
-            // Receive data from the client
-            if ( (received_message_size = bulk_read(client_fd, (char *) data, sizeof(int32_t[5])) ) < 0)
+            endpoint_t *endpoint = events[i].data.ptr;
+            switch (endpoint->type)
             {
-                ERR("read");
-            }
-#ifdef DEBUG
-            fprintf(stderr, "Received message of size %ld\n", received_message_size);
-#endif
-
-            if (received_message_size == sizeof(data)){
-                // Perform the calculation and send the result back to the client
-                perform_calculation(data);
-#ifdef DEBUG
-                fprintf(stderr, "Operand1: %d, Operand2: %d, Result: %d, Operation: %c, Status: %d\n",
-                        ntohl(data[OPERAND1_INDEX]), ntohl(data[OPERAND2_INDEX]), ntohl(data[RESULT_INDEX]), (char)ntohl(data[OPERATION_INDEX]), ntohl(data[STATUS_INDEX]));
-#endif
-                if (TEMP_FAILURE_RETRY(write(client_fd, data, sizeof(int32_t[5]))) < 0)
-                    ERR("write");
-            } else {
-                fprintf(stderr, "Received partial message\n");
+                case ENDPOINT_LISTENER:
+                    if (0 == drain_deadline_ms)
+                        ready_listeners[n_ready_listeners++] = endpoint;
+                    break;
+                case ENDPOINT_COMPLETIONS:
+                    handle_completions(epoll_fd, reactor);
+                    break;
+                case ENDPOINT_DATAGRAM:
+                    handle_datagrams(reactor, endpoint->fd);
+                    break;
+                case ENDPOINT_SHM_CHANNEL:
+                    handle_shm_channel((shm_channel_t *) endpoint);
+                    break;
+                case ENDPOINT_CONNECTION:
+                    handle_connection(epoll_fd, (connection_t *) endpoint, events[i].events);
+                    break;
+                case ENDPOINT_SHUTDOWN:
+                    // The eventfd is never read, so it stays readable and stops every reactor
+                    do_work = 0;
+                    break;
+                case ENDPOINT_DRAIN:
+                    // Another server accepts from the listeners now, keep serving the open connections only
+                    remove_endpoint(epoll_fd, &drain);
+                    remove_endpoint(epoll_fd, &tcp_listener);
+                    remove_endpoint(epoll_fd, &local_listener);
+                    remove_endpoint(epoll_fd, &udp_socket);
+                    if (reactor->dgram_socket_fd >= 0)
+                        remove_endpoint(epoll_fd, &dgram_socket);
+                    n_ready_listeners = 0;
+                    drain_deadline_ms = stats_clock() / 1000000 + DRAIN_TIMEOUT_MS;
+                    break;
             }
-
-            // Close the client socket
-            if (TEMP_FAILURE_RETRY(close(client_fd)) < 0)
-                ERR("close");
         }
+        accept_connections(epoll_fd, reactor, ready_listeners, n_ready_listeners);
+        if (wheel)
+            timer_wheel_advance(wheel, stats_clock() / 1000000, expire_idle_connection, NULL);
+        connection_free_closed();
+        if (drain_deadline_ms && (0 == open_connections || stats_clock() / 1000000 >= drain_deadline_ms))
+            do_work = 0;
     }
 
+    idle_timers = NULL;
+    free(wheel);
+
     // Close the epoll instance
     if (TEMP_FAILURE_RETRY(close(epoll_fd)) < 0)
         ERR("close");
 
-    return EXIT_SUCCESS;
+    return NULL;
+}
+
+/*
+ * io_uring backend:
+ * Every connection has exactly one read and at most one write in flight. Once a read completes, the replies are
+ * computed in place and a write of them is submitted, linked to the next read of the connection, so the whole
+ * exchange costs no system call of its own; the submissions of every completion in a batch go to the kernel
+ * together in the io_uring_enter call that waits for the next batch.
+ */
+
+typedef enum
+{
+    URING_ACCEPT,
+    URING_SHUTDOWN,
+    URING_DATAGRAM,
+    URING_DRAIN,
+    URING_DRAIN_TIMEOUT,
+    URING_CANCEL,
+    URING_READ,
+    URING_WRITE,
+} uring_operation_t;
+
+#define URING_DATA(operation, index) (((uint64_t)(index) << 8) | (operation))
+#define URING_OPERATION(data) ((uring_operation_t)((data) & 0xff))
+#define URING_INDEX(data) ((int)((data) >> 8))
+
+typedef struct
+{
+    connection_t connection;
+    int in_use;
+    int reading, writing; // Whether a read or a write of the connection is in flight
+} uring_connection_t;
+
+typedef struct
+{
+    uring_t ring;
+    int fixed_buffers;    // Whether the connection buffers are registered with the ring
+    uring_connection_t *connections;
+} uring_reactor_t;
+
+/// @brief Submit the next operations of a connection, or close it if it is done
+/// @param reactor Reactor state
+/// @param index Connection index
+void uring_advance(uring_reactor_t *reactor, int index)
+{
+    uring_connection_t *slot = &reactor->connections[index];
+    connection_t *connection = &slot->connection;
+    int read_space = CONNECTION_BUFFER_SIZE - (int)connection->read_length;
+    int fixed = reactor->fixed_buffers;
+
+    if (!slot->writing && connection->write_length > 0)
+    {
+        struct io_uring_sqe *sqe = uring_get_sqe(&reactor->ring);
+        uring_prep_rw(sqe, fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, connection->endpoint.fd,
+                      connection->write_buffer, connection->write_length, fixed ? 2 * index + 1 : -1,
+                      URING_DATA(URING_WRITE, index));
+        slot->writing = 1;
+
+        // The next read only starts after the replies were written, a short write cancels it
+        if (!slot->reading && CONNECTION_READING == connection->state && read_space > 0)
+            sqe->flags |= IOSQE_IO_LINK;
+    }
+    if (!slot->reading && CONNECTION_READING == connection->state && read_space > 0)
+    {
+        struct io_uring_sqe *sqe = uring_get_sqe(&reactor->ring);
+        uring_prep_rw(sqe, fixed ? IORING_OP_READ_FIXED : IORING_OP_READ, connection->endpoint.fd,
+                      connection->read_buffer + connection->read_length, read_space, fixed ? 2 * index : -1,
+                      URING_DATA(URING_READ, index));
+        slot->reading = 1;
+    }
+
+    if (CONNECTION_CLOSING == connection->state && !slot->reading && !slot->writing && 0 == connection->write_length)
+    {
+        if (connection->read_length > 0)
+            stats_count(STAT_PARTIAL_FRAMES, 1);
+        if (TEMP_FAILURE_RETRY(close(connection->endpoint.fd)) < 0)
+            ERR("close");
+        slot->in_use = 0;
+        open_connections--;
+        connection_trace(connection, NULL, 0);
+    }
+}
+
+/// @brief Handle a completed read of a connection
+void uring_handle_read(uring_reactor_t *reactor, int index, int result)
+{
+    uring_connection_t *slot = &reactor->connections[index];
+    connection_t *connection = &slot->connection;
+    slot->reading = 0;
+    if (-ECANCELED == result)
+        return; // The linked write was short, the read is submitted again once the write is done
+    if (result <= 0)
+        connection->state = CONNECTION_CLOSING;
+    else
+        connection->read_length += result;
+    process_requests(connection); // Only appends behind a write in flight, never moves its data
+
+}
+
+/// @brief Handle a completed write of a connection
+void uring_handle_write(uring_reactor_t *reactor, int index, int result)
+{
+    uring_connection_t *slot = &reactor->connections[index];
+    connection_t *connection = &slot->connection;
+    slot->writing = 0;
+    if (result < 0)
+    {
+        // The client is gone, drop the replies nobody will read
+        connection->state = CONNECTION_CLOSING;
+        connection->write_length = 0;
+        connection->read_length = 0;
+        return;
+    }
+    connection->write_offset = result;
+    connection_consume_written(connection);
+    // The read buffer must not move under a read in flight, its completion processes the requests instead
+    if (!slot->reading)
+        process_requests(connection);
+}
+
+/// @brief Handle a connection accepted by the multishot accept
+/// @param reactor Reactor state
+/// @param client_fd Client socket
+/// @param local Whether the client connected to the local socket
+void uring_handle_accept(uring_reactor_t *reactor, int client_fd, int local)
+{
+    for (int i = 0; i < URING_CONNECTIONS; i++)
+    {
+        uring_connection_t *slot = &reactor->connections[i];
+        if (slot->in_use)
+            continue;
+        slot->in_use = 1;
+        open_connections++;
+        slot->reading = slot->writing = 0;
+        slot->connection.endpoint.fd = client_fd;
+        slot->connection.id = __atomic_add_fetch(&next_connection_id, 1, __ATOMIC_RELAXED);
+        slot->connection.local = local;
+        slot->connection.state = CONNECTION_READING;
+        slot->connection.version = PROTOCOL_V1;
+        slot->connection.read_length = 0;
+        slot->connection.write_offset = slot->connection.write_length = 0;
+        uring_advance(reactor, i);
+        return;
+    }
+    fprintf(stderr, "Too many connections, refusing a client\n");
+    if (TEMP_FAILURE_RETRY(close(client_fd)) < 0)
+        ERR("close");
+}
+
+void *server_work_uring(void *args)
+{
+    reactor_t *reactor = args;
+    uring_reactor_t state;
+    thread_stats = reactor->stats;
+    thread_trace = reactor->trace;
+
+    if (uring_init(&state.ring, URING_ENTRIES) < 0)
+    {
+        perror("io_uring_setup");
+        fprintf(stderr, "[%d] io_uring is not available, falling back to epoll\n", reactor->id);
+        return server_work(args);
+    }
+
+    // Register the buffers of every connection slot (read buffer at 2 * index, write buffer at 2 * index + 1)
+    state.connections = calloc(URING_CONNECTIONS, sizeof(uring_connection_t));
+    if (NULL == state.connections)
+        ERR("calloc");
+    struct iovec iovecs[2 * URING_CONNECTIONS];
+    for (int i = 0; i < URING_CONNECTIONS; i++)
+    {
+        iovecs[2 * i].iov_base = state.connections[i].connection.read_buffer;
+        iovecs[2 * i].iov_len = CONNECTION_BUFFER_SIZE;
+        iovecs[2 * i + 1].iov_base = state.connections[i].connection.write_buffer;
+        iovecs[2 * i + 1].iov_len = CONNECTION_BUFFER_SIZE;
+    }
+    state.fixed_buffers = uring_register_buffers(&state.ring, iovecs, 2 * URING_CONNECTIONS) == 0;
+    if (!state.fixed_buffers)
+        fprintf(stderr, "[%d] Could not register buffers, using plain reads and writes\n", reactor->id);
+
+    // Accept on both listeners with multishot accepts and watch the shutdown eventfd
+    int listeners[2] = {reactor->tcp_socket_fd, reactor->local_socket_fd};
+    for (int i = 0; i < 2; i++)
+        uring_prep_multishot_accept(uring_get_sqe(&state.ring), listeners[i], URING_DATA(URING_ACCEPT, i));
+    uring_prep_poll(uring_get_sqe(&state.ring), reactor->shutdown_fd, POLLIN, URING_DATA(URING_SHUTDOWN, 0));
+    uring_prep_poll(uring_get_sqe(&state.ring), reactor->drain_fd, POLLIN, URING_DATA(URING_DRAIN, 0));
+
+    // Datagrams go through recvmmsg and sendmmsg as with epoll, the ring only tells when they are pending
+    int datagram_sockets[2] = {reactor->udp_socket_fd, reactor->dgram_socket_fd};
+    for (int i = 0; i < 2; i++)
+        if (datagram_sockets[i] >= 0)
+            uring_prep_poll(uring_get_sqe(&state.ring), datagram_sockets[i], POLLIN, URING_DATA(URING_DATAGRAM, i));
+
+    // Main server loop
+    int do_work = 1, draining = 0;
+    struct __kernel_timespec drain_timeout = {DRAIN_TIMEOUT_MS / 1000, DRAIN_TIMEOUT_MS % 1000 * 1000000};
+    while (do_work)
+    {
+        uring_submit(&state.ring, 1);
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&state.ring)) != NULL)
+        {
+            uint64_t data = cqe->user_data;
+            int result = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_cqe_seen(&state.ring);
+
+            int index = URING_INDEX(data);
+            switch (URING_OPERATION(data))
+            {
+                case URING_ACCEPT:
+                    if (result >= 0)
+                    {
+                        stats_count(STAT_ACCEPTED, 1);
+                        uring_handle_accept(&state, result, 1 == index); // Listener 1 is the local socket
+                    }
+                    else if (-EAGAIN != result && -EINTR != result && -ECONNABORTED != result &&
+                             -ECANCELED != result) // Cancelled when draining
+                    {
+                        errno = -result;
+                        ERR("accept");
+                    }
+                    // The kernel ends a multishot accept on errors, start it again
+                    if (!(flags & IORING_CQE_F_MORE) && !draining)
+                        uring_prep_multishot_accept(uring_get_sqe(&state.ring), listeners[index], data);
+                    break;
+                case URING_SHUTDOWN:
+                    do_work = 0;
+                    break;
+                case URING_DATAGRAM:
+                    if (-ECANCELED == result)
+                        break;
+                    if (result < 0 && -EINTR != result)
+                    {
+                        errno = -result;
+                        ERR("poll");
+                    }
+                    handle_datagrams(reactor, datagram_sockets[index]);
+                    if (!draining)
+                        uring_prep_poll(uring_get_sqe(&state.ring), datagram_sockets[index], POLLIN, data);
+                    break;
+                case URING_DRAIN:
+                    // Another server accepts from the listeners now, keep serving the open connections only
+                    draining = 1;
+                    for (int i = 0; i < 2; i++)
+                    {
+                        uring_prep_cancel(uring_get_sqe(&state.ring), URING_DATA(URING_ACCEPT, i), URING_DATA(URING_CANCEL, 0));
+                        if (datagram_sockets[i] >= 0)
+                            uring_prep_cancel(uring_get_sqe(&state.ring), URING_DATA(URING_DATAGRAM, i),
+                                              URING_DATA(URING_CANCEL, 0));
+                    }
+                    uring_prep_timeout(uring_get_sqe(&state.ring), &drain_timeout, URING_DATA(URING_DRAIN_TIMEOUT, 0));
+                    break;
+                case URING_DRAIN_TIMEOUT:
+                    do_work = 0;
+                    break;
+                case URING_CANCEL:
+                    break;
+                case URING_READ:
+                    uring_handle_read(&state, index, result);
+                    uring_advance(&state, index);
+                    break;
+                case URING_WRITE:
+                    uring_handle_write(&state, index, result);
+                    uring_advance(&state, index);
+                    break;
+            }
+        }
+        if (draining && 0 == open_connections)
+            do_work = 0;
+    }
+
+    // Closing the ring cancels the operations in flight
+    uring_destroy(&state.ring);
+    for (int i = 0; i < URING_CONNECTIONS; i++)
+        if (state.connections[i].in_use && TEMP_FAILURE_RETRY(close(state.connections[i].connection.endpoint.fd)) < 0)
+            ERR("close");
+    free(state.connections);
+
+    return NULL;
+}
+
+/*
+ * Admin socket:
+ * Every client of the admin socket gets the statistics of each reactor and their total, then the connection is
+ * closed (e.g. socat - UNIX-CONNECT:<name>). The reactors are never stopped or locked for it.
+ */
+
+typedef struct
+{
+    pthread_t thread;
+    int socket_fd;
+    int shutdown_fd;
+    reactor_t *reactors;
+    int n_reactors;
+} admin_t;
+
+/// @brief Send the statistics of the reactors to a client of the admin socket and close the connection
+/// @param admin Admin socket state
+/// @param client_fd Client socket
+void admin_report(admin_t *admin, int client_fd)
+{
+    // A client that does not read its report must not stall the admin thread
+    struct timeval timeout = {1, 0};
+    if (setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)))
+        ERR("setsockopt");
+    FILE *out = fdopen(client_fd, "w");
+    if (NULL == out)
+        ERR("fdopen");
+
+    server_stats_t *total = stats_create();
+    char name[32];
+    for (int i = 0; i < admin->n_reactors; i++)
+    {
+        server_stats_t *snapshot = stats_create();
+        stats_merge(snapshot, admin->reactors[i].stats);
+        stats_merge(total, snapshot);
+        snprintf(name, sizeof(name), "reactor%d", i);
+        stats_print(out, name, snapshot);
+        free(snapshot);
+    }
+    stats_print(out, "total", total);
+    free(total);
+
+    // The client may be gone already, which is none of the server's business
+    fclose(out);
+}
+
+void *admin_work(void *args)
+{
+    admin_t *admin = args;
+    struct pollfd fds[2] = {{admin->socket_fd, POLLIN, 0}, {admin->shutdown_fd, POLLIN, 0}};
+    for (;;)
+    {
+        if (TEMP_FAILURE_RETRY(poll(fds, 2, -1)) < 0)
+            ERR("poll");
+        if (fds[1].revents & POLLIN)
+            return NULL;
+        int client_fd = add_new_client(admin->socket_fd);
+        if (client_fd < 0)
+            continue;
+        make_blocking(client_fd);
+        admin_report(admin, client_fd);
+    }
+}
+
+/*
+ * Hot restart:
+ * A server started with -u serves a handoff socket. A new server started with the same -u connects to it and
+ * receives the listeners (the local stream and datagram sockets and the TCP and UDP sockets of every reactor)
+ * with SCM_RIGHTS, so the backlogs are never closed and no client is ever refused. The old server then stops
+ * accepting, lets its open connections finish (for at most DRAIN_TIMEOUT_MS) and exits without unlinking any
+ * socket name, they belong to the new server.
+ */
+
+typedef struct
+{
+    int32_t n_reactors;
+    int32_t has_dgram_socket;
+} handoff_header_t;
+
+/// @brief Take the listeners over from the server serving the handoff socket, if there is one
+/// @param handoff_name Name of the handoff socket
+/// @param n_reactors Set to the number of reactors of the old server (one per pair of TCP and UDP sockets)
+/// @param local_socket_fd Set to the local stream listener
+/// @param dgram_socket_fd Set to the local datagram socket, -1 if the old server had none
+/// @param reactors The TCP and UDP sockets of the reactors are set
+/// @return 1 if the listeners were taken over, 0 if no server serves the handoff socket
+int handoff_receive(char *handoff_name, int *n_reactors, int *local_socket_fd, int *dgram_socket_fd,
+                    reactor_t *reactors)
+{
+    int handoff_fd = try_connect_local_socket(handoff_name);
+    if (handoff_fd < 0)
+        return 0;
+    handoff_header_t header;
+    int fds[2 + 2 * MAX_REACTORS];
+    int count = receive_fds(handoff_fd, &header, sizeof(header), fds, 2 + 2 * MAX_REACTORS);
+    if (count < 0 || header.n_reactors < 1 || header.n_reactors > MAX_REACTORS ||
+        count != 1 + header.has_dgram_socket + 2 * header.n_reactors)
+    {
+        fprintf(stderr, "Invalid handoff from the running server\n");
+        exit(EXIT_FAILURE);
+    }
+    if (TEMP_FAILURE_RETRY(close(handoff_fd)) < 0)
+        ERR("close");
+
+    int *fd = fds;
+    *local_socket_fd = *fd++;
+    *dgram_socket_fd = header.has_dgram_socket ? *fd++ : -1;
+    *n_reactors = header.n_reactors;
+    for (int i = 0; i < header.n_reactors; i++)
+    {
+        reactors[i].tcp_socket_fd = *fd++;
+        reactors[i].udp_socket_fd = *fd++;
+    }
+    return 1;
+}
+
+/// @brief Send the listeners to a new server
+/// @param client_fd Connection of the new server to the handoff socket
+void handoff_send(int client_fd, int local_socket_fd, int dgram_socket_fd, reactor_t *reactors, int n_reactors)
+{
+    handoff_header_t header = {n_reactors, dgram_socket_fd >= 0};
+    int fds[2 + 2 * MAX_REACTORS], count = 0;
+    fds[count++] = local_socket_fd;
+    if (dgram_socket_fd >= 0)
+        fds[count++] = dgram_socket_fd;
+    for (int i = 0; i < n_reactors; i++)
+    {
+        fds[count++] = reactors[i].tcp_socket_fd;
+        fds[count++] = reactors[i].udp_socket_fd;
+    }
+    if (send_fds(client_fd, &header, sizeof(header), fds, count) < 0)
+        ERR("send_fds");
 }
 
 int main(int argc, char **argv)
 {
-    // Parse command line arguments (local socket name and port number)
-    if (argc != 3)
+    // Parse command line arguments (number of reactors, local socket name and port number)
+    int n_reactors = 1, n_workers = 0, accept_budget = DEFAULT_ACCEPT_BUDGET, opt;
+    char *dgram_name = NULL, *admin_name = NULL, *handoff_name = NULL, *capture_name = NULL;
+    backend_t backend = BACKEND_EPOLL;
+    while ((opt = getopt(argc, argv, "j:b:w:a:d:s:i:u:c:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c':
+                capture_name = optarg;
+                break;
+            case 'd':
+                dgram_name = optarg;
+                break;
+            case 's':
+                admin_name = optarg;
+                break;
+            case 'u':
+                handoff_name = optarg;
+                break;
+            case 'i':
+                if (atoi(optarg) < 1)
+                    usage(argv[0]);
+                idle_timeout_ms = 1000 * (uint64_t)atoi(optarg);
+                break;
+            case 'a':
+                accept_budget = atoi(optarg);
+                if (accept_budget < 1)
+                    usage(argv[0]);
+                break;
+            case 'w':
+                n_workers = atoi(optarg);
+                if (n_workers < 1 || n_workers > MAX_WORKERS)
+                    usage(argv[0]);
+                break;
+            case 'b':
+                if (0 == strcmp(optarg, "epoll"))
+                    backend = BACKEND_EPOLL;
+                else if (0 == strcmp(optarg, "uring"))
+                    backend = BACKEND_URING;
+                else
+                    usage(argv[0]);
+                break;
+            case 'j':
+                n_reactors = atoi(optarg);
+                if (n_reactors < 1 || n_reactors > MAX_REACTORS)
+                    usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2)
         usage(argv[0]);
-    char *name = argv[1];
-    uint16_t port = atoi(argv[2]);
+    char *name = argv[optind];
+    int port = atoi(argv[optind + 1]);
     if (port < 1 || port > 65535)
         usage(argv[0]);
 
-    sethandler(sigint_handler, SIGINT); // Handle SIGINT
     sethandler(SIG_IGN, SIGPIPE); // Ignore SIGPIPE
+    calculate_batch = select_batch_kernel();
 
-    // Create a TCP socket, bind it to a port and start listening, set it to non-blocking mode
-    int tcp_socket_fd = bind_tcp_socket(port, SOMAXCONN);
-    int tcp_socket_flags = fcntl(tcp_socket_fd, F_GETFL) | O_NONBLOCK;
-    if (tcp_socket_flags < 0)
-        ERR("fcntl");
-    if (fcntl(tcp_socket_fd, F_SETFL, tcp_socket_flags) < 0)
-        ERR("fcntl");
+    // Block SIGINT before starting the reactors, so that only the main thread receives it (through a signalfd)
+    sigset_t sigmask, old_mask;
+    sigemptyset(&sigmask);
+    sigaddset(&sigmask, SIGINT);
+    if (pthread_sigmask(SIG_BLOCK, &sigmask, &old_mask))
+        ERR("pthread_sigmask");
 
-    fprintf(stderr, "Listening on port %d\n", port);
+    // Start the worker pool, the io_uring backend computes the requests in its reactors
+    worker_pool_t pool;
+    if (n_workers > 0 && BACKEND_EPOLL == backend)
+    {
+        worker_pool_init(&pool, n_workers, POOL_QUEUE_SIZE, perform_job);
+        worker_pool = &pool;
+    }
+    else if (n_workers > 0)
+        fprintf(stderr, "The worker pool is only used with the epoll backend\n");
+    if (idle_timeout_ms > 0 && BACKEND_URING == backend)
+        fprintf(stderr, "Idle timeouts are only enforced by the epoll backend\n");
 
-    // Create a local socket, bind it to a name and start listening, set it to non-blocking mode
-    int local_socket_fd = bind_local_socket(name, SOMAXCONN);
-    int local_socket_flags = fcntl(local_socket_fd, F_GETFL) | O_NONBLOCK;
-    if (local_socket_flags < 0)
-        ERR("fcntl");
-    if (fcntl(local_socket_fd, F_SETFL, local_socket_flags) < 0)
-        ERR("fcntl");
+    // Take the listeners over from a running server, they already are non-blocking
+    reactor_t reactors[MAX_REACTORS];
+    int local_socket_fd, dgram_socket_fd = -1, requested_reactors = n_reactors;
+    int taken_over = handoff_name && handoff_receive(handoff_name, &n_reactors, &local_socket_fd, &dgram_socket_fd,
+                                                     reactors);
+    if (taken_over)
+    {
+        fprintf(stderr, "Took the listeners of %d reactor(s) over from the running server\n", n_reactors);
+        if (requested_reactors != n_reactors)
+            fprintf(stderr, "Running %d reactor(s) instead of %d, one per TCP listener\n", n_reactors,
+                    requested_reactors);
+        if (dgram_socket_fd >= 0 && NULL == dgram_name)
+        {
+            if (TEMP_FAILURE_RETRY(close(dgram_socket_fd)) < 0)
+                ERR("close");
+            dgram_socket_fd = -1;
+        }
+    }
+    else
+    {
+        // Create a local socket, bind it to a name and start listening, set it to non-blocking mode
+        local_socket_fd = bind_local_socket(name, SOMAXCONN);
+        make_nonblocking(local_socket_fd);
+    }
 
     fprintf(stderr, "Listening on local socket %s\n", name);
 
-    // Start the server work
-    server_work(tcp_socket_fd, local_socket_fd);
+    // Create the local datagram socket if requested
+    if (dgram_name)
+    {
+        if (dgram_socket_fd < 0)
+            dgram_socket_fd = bind_local_dgram_socket(dgram_name);
+        fprintf(stderr, "Receiving datagrams on local socket %s\n", dgram_name);
+    }
 
-    // Close the TCP and local sockets
-    if (TEMP_FAILURE_RETRY(close(tcp_socket_fd)) < 0)
-        ERR("close");
+    int shutdown_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shutdown_fd < 0)
+        ERR("eventfd");
+    int drain_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (drain_fd < 0)
+        ERR("eventfd");
+
+    // Start capturing before the reactors accept anything
+    trace_writer_t *capture = NULL;
+    if (capture_name)
+    {
+        capture = trace_writer_start(capture_name, n_reactors);
+        fprintf(stderr, "Capturing requests to %s\n", capture_name);
+    }
+
+    // Start the reactors, each with its own TCP listener on the same port (SO_REUSEPORT)
+    for (int i = 0; i < n_reactors; i++)
+    {
+        reactors[i].id = i;
+        if (!taken_over)
+        {
+            reactors[i].tcp_socket_fd = bind_tcp_socket_reuseport(port, SOMAXCONN);
+            make_nonblocking(reactors[i].tcp_socket_fd);
+            reactors[i].udp_socket_fd = bind_udp_socket_reuseport(port);
+        }
+        reactors[i].local_socket_fd = local_socket_fd;
+        reactors[i].shutdown_fd = shutdown_fd;
+        reactors[i].drain_fd = drain_fd;
+        reactors[i].backend = backend;
+        reactors[i].accept_budget = accept_budget;
+        reactors[i].stats = stats_create();
+        reactors[i].dgram_socket_fd = dgram_socket_fd;
+        reactors[i].datagrams = datagram_batch_create();
+        reactors[i].trace = capture ? &capture->rings[i] : NULL;
+        if (worker_pool)
+            completion_queue_init(&reactors[i].completions, POOL_QUEUE_SIZE);
+        if (pthread_create(&reactors[i].thread, NULL, BACKEND_URING == backend ? server_work_uring : server_work,
+                           &reactors[i]))
+            ERR("pthread_create");
+    }
+
+    fprintf(stderr, "Listening on port %d with %d reactor(s)\n", port, n_reactors);
+
+    // Serve the statistics on the admin socket
+    admin_t admin = {.socket_fd = -1, .shutdown_fd = shutdown_fd, .reactors = reactors, .n_reactors = n_reactors};
+    if (admin_name)
+    {
+        admin.socket_fd = bind_local_socket(admin_name, SOMAXCONN);
+        make_nonblocking(admin.socket_fd);
+        if (pthread_create(&admin.thread, NULL, admin_work, &admin))
+            ERR("pthread_create");
+        fprintf(stderr, "Serving statistics on local socket %s\n", admin_name);
+    }
+
+    // Serve the handoff socket for the next server
+    int handoff_fd = -1;
+    if (handoff_name)
+    {
+        handoff_fd = bind_local_socket(handoff_name, 1);
+        make_nonblocking(handoff_fd);
+    }
+
+    // Wait for SIGINT and stop the reactors, or for a new server and let the reactors drain
+    int signal_fd = signalfd(-1, &sigmask, SFD_CLOEXEC);
+    if (signal_fd < 0)
+        ERR("signalfd");
+    struct pollfd waits[2] = {{signal_fd, POLLIN, 0}, {handoff_fd, POLLIN, 0}};
+    int handed_off = 0;
+    while (!handed_off && !(waits[0].revents & POLLIN))
+    {
+        if (TEMP_FAILURE_RETRY(poll(waits, 2, -1)) < 0)
+            ERR("poll");
+        if (waits[1].revents & POLLIN)
+        {
+            int client_fd = add_new_client(handoff_fd);
+            if (client_fd < 0)
+                continue;
+            handoff_send(client_fd, local_socket_fd, dgram_socket_fd, reactors, n_reactors);
+            if (TEMP_FAILURE_RETRY(close(client_fd)) < 0)
+                ERR("close");
+            fprintf(stderr, "Handed the listeners over, draining the open connections\n");
+            handed_off = 1;
+        }
+    }
+    uint64_t one = 1;
+    if (TEMP_FAILURE_RETRY(write(handed_off ? drain_fd : shutdown_fd, &one, sizeof(one))) < 0)
+        ERR("write");
+    for (int i = 0; i < n_reactors; i++)
+    {
+        if (pthread_join(reactors[i].thread, NULL))
+            ERR("pthread_join");
+        uint64_t *counters = reactors[i].stats->counters;
+        fprintf(stderr, "Reactor %d: accepted %" PRIu64 " connections, accept budget exhausted %" PRIu64 " times\n", i,
+                counters[STAT_ACCEPTED], counters[STAT_ACCEPT_DEFERRED]);
+        fprintf(stderr, "Reactor %d: received %" PRIu64 " datagrams, dropped %" PRIu64 "\n", i,
+                counters[STAT_DATAGRAMS_RECEIVED], counters[STAT_DATAGRAMS_DROPPED]);
+        // Close the TCP and UDP sockets of the reactor
+        if (TEMP_FAILURE_RETRY(close(reactors[i].tcp_socket_fd)) < 0)
+            ERR("close");
+        if (TEMP_FAILURE_RETRY(close(reactors[i].udp_socket_fd)) < 0)
+            ERR("close");
+        if (capture)
+            fprintf(stderr, "Reactor %d: dropped %" PRIu64 " captured requests\n", i, counters[STAT_TRACE_DROPPED]);
+        free(reactors[i].datagrams);
+        free(reactors[i].stats);
+    }
+    if (capture)
+    {
+        uint64_t captured = trace_writer_stop(capture);
+        fprintf(stderr, "Captured %" PRIu64 " bytes of requests to %s\n", captured, capture_name);
+    }
+
+    // The admin socket stays up while the reactors drain
+    if (admin_name)
+    {
+        if (TEMP_FAILURE_RETRY(write(shutdown_fd, &one, sizeof(one))) < 0)
+            ERR("write");
+        if (pthread_join(admin.thread, NULL))
+            ERR("pthread_join");
+        if (TEMP_FAILURE_RETRY(close(admin.socket_fd)) < 0)
+            ERR("close");
+    }
+
+    // The workers may still report to the completion queues, so they go after the pool
+    if (worker_pool)
+    {
+        worker_pool_destroy(worker_pool);
+        for (int i = 0; i < n_reactors; i++)
+            completion_queue_destroy(&reactors[i].completions);
+    }
+
+    // Close the local sockets and the eventfds
     if (TEMP_FAILURE_RETRY(close(local_socket_fd)) < 0)
         ERR("close");
+    if (dgram_socket_fd >= 0 && TEMP_FAILURE_RETRY(close(dgram_socket_fd)) < 0)
+        ERR("close");
+    if (handoff_fd >= 0 && TEMP_FAILURE_RETRY(close(handoff_fd)) < 0)
+        ERR("close");
+    if (TEMP_FAILURE_RETRY(close(shutdown_fd)) < 0 || TEMP_FAILURE_RETRY(close(drain_fd)) < 0 ||
+        TEMP_FAILURE_RETRY(close(signal_fd)) < 0)
+        ERR("close");
 
-    // Unlink the local socket
-    unlink_local_socket(name);
+    // Unlink the local sockets, unless they were handed over together with the listeners
+    if (!handed_off)
+    {
+        unlink_local_socket(name);
+        if (dgram_name)
+            unlink_local_socket(dgram_name);
+        if (admin_name)
+            unlink_local_socket(admin_name);
+        if (handoff_name)
+            unlink_local_socket(handoff_name);
+    }
 
     fprintf(stderr, "Server finished\n");
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -0,0 +1,142 @@
+//
+// Shared-memory transport between the calculator server and clients on the same host.
+//
+// A local client asks for it with an OPERATION_SHM frame on its stream connection; the server answers with
+// a memfd holding two single-producer single-consumer rings of frames (requests and replies) and two eventfds,
+// passed with SCM_RIGHTS. From then on frames go through the rings and the stream connection only tells either
+// side that the other one is gone.
+//
+// A consumer that finds its ring empty raises its sleeping flag, checks the ring once more and only then waits
+// for its eventfd; a producer writes the eventfd only if it finds the flag raised (and lowers it), so as long as
+// both sides keep up, a round trip costs no system call at all.
+//
+
+#ifndef SOCKETS_SHM_RING_H
+#define SOCKETS_SHM_RING_H
+
+#include "socklib.h"
+#include "macros.h"
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#define SHM_RING_SLOTS 1024 // Frames per ring, a power of two
+#define SHM_VERSION 1
+
+typedef struct
+{
+    _Alignas(64) uint32_t tail;         // Written by the producer only
+    _Alignas(64) uint32_t head;         // Written by the consumer only
+    _Alignas(64) int consumer_sleeping; // Raised by the consumer before it waits for its eventfd
+    int32_t frames[SHM_RING_SLOTS][MESSAGE_SIZE];
+} shm_ring_t;
+
+typedef struct
+{
+    uint32_t version;
+    uint32_t slots;
+    shm_ring_t requests; // Client to server
+    shm_ring_t replies;  // Server to client
+} shm_region_t;
+
+/*
+ * Ring operations
+ */
+
+/// @brief Append a frame (producer side), the consumer is not woken up yet
+/// @return 0 on success, -1 if the ring is full
+int shm_ring_push(shm_ring_t *ring, const int32_t *frame)
+{
+    uint32_t tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == SHM_RING_SLOTS)
+        return -1;
+    memcpy(ring->frames[tail & (SHM_RING_SLOTS - 1)], frame, sizeof(int32_t[MESSAGE_SIZE]));
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/// @brief Take the oldest frame (consumer side)
+/// @return 0 on success, -1 if the ring is empty
+int shm_ring_pop(shm_ring_t *ring, int32_t *frame)
+{
+    uint32_t head = ring->head;
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+        return -1;
+    memcpy(frame, ring->frames[head & (SHM_RING_SLOTS - 1)], sizeof(int32_t[MESSAGE_SIZE]));
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/// @brief Wake the consumer up after pushing frames, if it went to sleep
+/// @param ring Ring
+/// @param event_fd Eventfd the consumer waits for
+void shm_ring_notify(shm_ring_t *ring, int event_fd)
+{
+    if (__atomic_exchange_n(&ring->consumer_sleeping, 0, __ATOMIC_SEQ_CST))
+    {
+        uint64_t one = 1;
+        if (TEMP_FAILURE_RETRY(write(event_fd, &one, sizeof(one))) < 0)
+            ERR("write");
+    }
+}
+
+/// @brief Announce that the consumer is about to wait for its eventfd
+/// @return 0 if it may wait, -1 if frames arrived in the meantime (the flag is lowered again)
+int shm_ring_prepare_sleep(shm_ring_t *ring)
+{
+    __atomic_store_n(&ring->consumer_sleeping, 1, __ATOMIC_SEQ_CST);
+    if (ring->head == __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST))
+        return 0;
+    __atomic_store_n(&ring->consumer_sleeping, 0, __ATOMIC_RELAXED);
+    return -1;
+}
+
+/*
+ * Setup
+ */
+
+/// @brief Create a shared region and the eventfds of both directions (server side)
+/// @param memory_fd Set to the memfd of the region
+/// @param request_fd Set to the eventfd the server waits for (non-blocking)
+/// @param reply_fd Set to the eventfd the client waits for
+/// @return Mapped region
+shm_region_t *shm_region_create(int *memory_fd, int *request_fd, int *reply_fd)
+{
+    if ((*memory_fd = memfd_create("calculator-shm", MFD_CLOEXEC)) < 0)
+        ERR("memfd_create");
+    if (ftruncate(*memory_fd, sizeof(shm_region_t)) < 0)
+        ERR("ftruncate");
+    shm_region_t *region = mmap(NULL, sizeof(shm_region_t), PROT_READ | PROT_WRITE, MAP_SHARED, *memory_fd, 0);
+    if (MAP_FAILED == region)
+        ERR("mmap");
+    region->version = SHM_VERSION;
+    region->slots = SHM_RING_SLOTS;
+    // The server waits for its eventfd until the first request arrives
+    region->requests.consumer_sleeping = 1;
+    if ((*request_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 || (*reply_fd = eventfd(0, EFD_CLOEXEC)) < 0)
+        ERR("eventfd");
+    return region;
+}
+
+/// @brief Map a region received from the server (client side)
+/// @return Mapped region, NULL if it is not of a known version
+shm_region_t *shm_region_map(int memory_fd)
+{
+    shm_region_t *region = mmap(NULL, sizeof(shm_region_t), PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd, 0);
+    if (MAP_FAILED == region)
+        ERR("mmap");
+    if (SHM_VERSION != region->version || SHM_RING_SLOTS != region->slots)
+    {
+        if (munmap(region, sizeof(shm_region_t)) < 0)
+            ERR("munmap");
+        return NULL;
+    }
+    return region;
+}
+
+void shm_region_unmap(shm_region_t *region)
+{
+    if (munmap(region, sizeof(shm_region_t)) < 0)
+        ERR("munmap");
+}
+
+#endif // SOCKETS_SHM_RING_H
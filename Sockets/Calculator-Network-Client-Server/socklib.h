@@ -1,3 +1,6 @@
+#ifndef SOCKETS_SOCKLIB_H
+#define SOCKETS_SOCKLIB_H
+
 #define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
@@ -45,6 +48,7 @@ int sethandler(void (*f)(int), int sigNo)
  * Local Sockets:
  * - make_local_socket
  * - connect_local_socket
+ * - try_connect_local_socket
  * - bind_local_socket
  * - unlink_local_socket
  */
@@ -79,6 +83,24 @@ int connect_local_socket(char *name)
     return socketfd;
 }
 
+/// @brief Connect to a local socket that may not exist or have no server listening on it
+/// @param name Socket name
+/// @return Socket file descriptor, -1 if there is no server
+int try_connect_local_socket(char *name)
+{
+    struct sockaddr_un addr;
+    int socketfd = make_local_socket(name, &addr);
+    if (connect(socketfd, (struct sockaddr *)&addr, SUN_LEN(&addr)) < 0)
+    {
+        if (ENOENT != errno && ECONNREFUSED != errno)
+            ERR("connect");
+        if (TEMP_FAILURE_RETRY(close(socketfd)) < 0)
+            ERR("close");
+        return -1;
+    }
+    return socketfd;
+}
+
 /// @brief Create a local socket, bind it to a name and start listening
 /// @param name Socket name
 /// @param backlog_size Maximum number of pending connections
@@ -111,6 +133,7 @@ void unlink_local_socket(char *name)
  * - make_address
  * - connect_tcp_socket
  * - bind_tcp_socket
+ * - bind_tcp_socket_reuseport
  * - add_new_client
  */
 /// @brief Create a TCP socket
@@ -162,15 +185,14 @@ int connect_tcp_socket(char *name, char *port)
     return socketfd;
 }
 
-/// @brief Create a TCP socket, bind it to a port and start listening
+/// @brief Bind a TCP socket to a port on all interfaces and start listening
+/// @param socketfd TCP socket file descriptor
 /// @param port Port number
 /// @param backlog_size Maximum number of pending connections
-/// @return Socket file descriptor
-int bind_tcp_socket(uint16_t port, int backlog_size)
+void listen_tcp_socket(int socketfd, uint16_t port, int backlog_size)
 {
     struct sockaddr_in addr;
-    int socketfd, t = 1;
-    socketfd = make_tcp_socket();
+    int t = 1;
     memset(&addr, 0, sizeof(struct sockaddr_in));
     addr.sin_family = AF_INET;
     addr.sin_port = htons(port);
@@ -181,27 +203,236 @@ int bind_tcp_socket(uint16_t port, int backlog_size)
         ERR("bind");
     if (listen(socketfd, backlog_size) < 0)
         ERR("listen");
+}
+
+/// @brief Create a TCP socket, bind it to a port and start listening
+/// @param port Port number
+/// @param backlog_size Maximum number of pending connections
+/// @return Socket file descriptor
+int bind_tcp_socket(uint16_t port, int backlog_size)
+{
+    int socketfd = make_tcp_socket();
+    listen_tcp_socket(socketfd, port, backlog_size);
+    return socketfd;
+}
+
+/// @brief Create a TCP socket with SO_REUSEPORT, bind it to a port and start listening.
+/// Several such sockets may listen on the same port, the kernel spreads incoming connections between them.
+/// @param port Port number
+/// @param backlog_size Maximum number of pending connections (per socket)
+/// @return Socket file descriptor
+int bind_tcp_socket_reuseport(uint16_t port, int backlog_size)
+{
+    int socketfd = make_tcp_socket(), t = 1;
+    if (setsockopt(socketfd, SOL_SOCKET, SO_REUSEPORT, &t, sizeof(t)))
+        ERR("setsockopt");
+    listen_tcp_socket(socketfd, port, backlog_size);
     return socketfd;
 }
 
 /// @brief Add a new client to the server
 /// @param sfd Server socket file descriptor
-/// @return Client socket file descriptor
+/// @return Client socket file descriptor (non-blocking and close-on-exec), -1 if there is no pending connection
 int add_new_client(int sfd)
 {
     int nfd;
-    if ((nfd = TEMP_FAILURE_RETRY(accept(sfd, NULL, NULL))) < 0)
+    while ((nfd = TEMP_FAILURE_RETRY(accept4(sfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC))) < 0)
     {
         if (EAGAIN == errno || EWOULDBLOCK == errno)
             return -1;
-        ERR("accept");
+        // The client gave up before we got to it, try the next one
+        if (ECONNABORTED == errno)
+            continue;
+        ERR("accept4");
     }
     return nfd;
 }
 
+/*
+ * Datagram Sockets:
+ * - bind_local_dgram_socket
+ * - connect_local_dgram_socket
+ * - bind_udp_socket_reuseport
+ * - connect_udp_socket
+ */
+
+/// @brief Create a local datagram socket and bind it to a name
+/// @param name Socket name
+/// @return Socket file descriptor
+int bind_local_dgram_socket(char *name)
+{
+    struct sockaddr_un addr;
+    int socketfd;
+    if (unlink(name) < 0 && errno != ENOENT)
+        ERR("unlink");
+    if ((socketfd = socket(PF_UNIX, SOCK_DGRAM, 0)) < 0)
+        ERR("socket");
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, name, sizeof(addr.sun_path) - 1);
+    if (bind(socketfd, (struct sockaddr *)&addr, SUN_LEN(&addr)) < 0)
+        ERR("bind");
+    return socketfd;
+}
+
+/// @brief Create a local datagram socket and connect it to a server.
+/// The socket is bound to an autogenerated abstract name, so that the server can send replies back.
+/// @param name Socket name of the server
+/// @return Socket file descriptor
+int connect_local_dgram_socket(char *name)
+{
+    struct sockaddr_un addr;
+    int socketfd;
+    if ((socketfd = socket(PF_UNIX, SOCK_DGRAM, 0)) < 0)
+        ERR("socket");
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    if (bind(socketfd, (struct sockaddr *)&addr, sizeof(sa_family_t)) < 0)
+        ERR("bind");
+    strncpy(addr.sun_path, name, sizeof(addr.sun_path) - 1);
+    if (connect(socketfd, (struct sockaddr *)&addr, SUN_LEN(&addr)) < 0)
+        ERR("connect");
+    return socketfd;
+}
+
+/// @brief Create a UDP socket with SO_REUSEPORT and bind it to a port on all interfaces.
+/// Several such sockets may be bound to the same port, the kernel spreads incoming datagrams between them.
+/// @param port Port number
+/// @return Socket file descriptor
+int bind_udp_socket_reuseport(uint16_t port)
+{
+    struct sockaddr_in addr;
+    int socketfd, t = 1;
+    if ((socketfd = socket(PF_INET, SOCK_DGRAM, 0)) < 0)
+        ERR("socket");
+    if (setsockopt(socketfd, SOL_SOCKET, SO_REUSEPORT, &t, sizeof(t)))
+        ERR("setsockopt");
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(socketfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        ERR("bind");
+    return socketfd;
+}
+
+/// @brief Create a UDP socket and connect it to a server
+/// @param name Server address
+/// @param port Server port
+/// @return Socket file descriptor
+int connect_udp_socket(char *name, char *port)
+{
+    struct sockaddr_in addr;
+    int socketfd;
+    if ((socketfd = socket(PF_INET, SOCK_DGRAM, 0)) < 0)
+        ERR("socket");
+    addr = make_address(name, port);
+    if (connect(socketfd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) < 0)
+        ERR("connect");
+    return socketfd;
+}
+
+/*
+ * Descriptor passing (SCM_RIGHTS over local sockets):
+ * - send_fds
+ * - receive_fds
+ */
+
+/// @brief Send a message together with file descriptors, the receiver gets its own copies of them
+/// @param socketfd Local socket file descriptor
+/// @param data Message
+/// @param size Size of the message (at least 1 byte)
+/// @param fds File descriptors
+/// @param count Number of file descriptors (at most 253)
+/// @return 0 on success, -1 if the peer is gone or the socket would block
+int send_fds(int socketfd, void *data, size_t size, int *fds, int count)
+{
+    struct iovec iov = {data, size};
+    size_t control_size = CMSG_SPACE(count * sizeof(int));
+    char *control = calloc(1, control_size);
+    if (NULL == control)
+        ERR("calloc");
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = control_size;
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(header), fds, count * sizeof(int));
+    ssize_t c = TEMP_FAILURE_RETRY(sendmsg(socketfd, &message, 0));
+    if (c < 0 && EAGAIN != errno && EWOULDBLOCK != errno && EPIPE != errno && ECONNRESET != errno)
+        ERR("sendmsg");
+    free(control);
+    return (size_t)c == size ? 0 : -1;
+}
+
+/// @brief Receive a message sent with send_fds
+/// @param socketfd Local socket file descriptor
+/// @param data Buffer for the message
+/// @param size Size of the message
+/// @param fds Buffer for the file descriptors (close-on-exec)
+/// @param max_count Size of the buffer
+/// @return Number of file descriptors received, -1 if the peer closed the connection without sending
+int receive_fds(int socketfd, void *data, size_t size, int *fds, int max_count)
+{
+    struct iovec iov = {data, size};
+    size_t control_size = CMSG_SPACE(max_count * sizeof(int));
+    char *control = calloc(1, control_size);
+    if (NULL == control)
+        ERR("calloc");
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = control_size;
+    ssize_t c = TEMP_FAILURE_RETRY(recvmsg(socketfd, &message, MSG_CMSG_CLOEXEC | MSG_WAITALL));
+    if (c < 0)
+        ERR("recvmsg");
+    if (message.msg_flags & MSG_CTRUNC)
+    {
+        fprintf(stderr, "Received too many file descriptors\n");
+        exit(EXIT_FAILURE);
+    }
+    int count = 0;
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header))
+        if (SOL_SOCKET == header->cmsg_level && SCM_RIGHTS == header->cmsg_type)
+        {
+            count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(header), count * sizeof(int));
+        }
+    free(control);
+    return (size_t)c == size ? count : -1;
+}
+
 /*
  * Utility functions:
  */
+/// @brief Switch a file descriptor to non-blocking mode
+/// @param fd File descriptor
+void make_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0)
+        ERR("fcntl");
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        ERR("fcntl");
+}
+
+/// @brief Switch a file descriptor back to blocking mode
+/// @param fd File descriptor
+void make_blocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0)
+        ERR("fcntl");
+    if (fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0)
+        ERR("fcntl");
+}
+
+
 /// @brief Read data from a file descriptor in bulk (Doesn't work with
 ssize_t bulk_read(int fd, char *buf, size_t count)
 {
@@ -235,4 +466,6 @@ ssize_t bulk_write(int fd, char *buf, size_t count)
         count -= c;
     } while (count > 0);
     return len;
-}
\ No newline at end of file
+}
+
+#endif // SOCKETS_SOCKLIB_H
@@ -0,0 +1,195 @@
+//
+// Always-on instrumentation of the calculator server.
+//
+// Every reactor thread owns a server_stats_t (reached through thread_stats) and is its only writer: counters and
+// histograms are bumped with relaxed atomic stores, no locks and no shared cache lines on the hot path. Readers
+// (the admin socket) merge the structures of all reactors with relaxed loads whenever they are asked to.
+//
+
+#ifndef SOCKETS_STATS_H
+#define SOCKETS_STATS_H
+
+#include "socklib.h"
+#include "macros.h"
+#include "histogram.h"
+#include <inttypes.h>
+#include <time.h>
+
+typedef enum
+{
+    STAT_ACCEPTED,
+    STAT_ACCEPT_DEFERRED, // Wakeups that ran out of accept budget with connections still pending
+    STAT_REQUESTS_ADD,
+    STAT_REQUESTS_SUBTRACT,
+    STAT_REQUESTS_MULTIPLY,
+    STAT_REQUESTS_DIVIDE,
+    STAT_REQUESTS_UNKNOWN,  // Operations the calculator does not know
+    STAT_BATCHES,           // Batch frames, their operations are also counted above
+    STAT_EXPRESSIONS,       // Expression frames
+    STAT_EXPRESSION_TUPLES, // Tuples the expressions were evaluated on
+    STAT_DIVISION_BY_ZERO,
+    STAT_MALFORMED,      // Requests that could not be framed
+    STAT_PARTIAL_FRAMES, // Connections closed in the middle of a frame
+    STAT_IDLE_TIMEOUTS,  // Connections closed after idle_timeout_ms without activity
+    STAT_DATAGRAMS_RECEIVED,
+    STAT_DATAGRAMS_DROPPED, // Malformed requests and replies that could not be sent
+    STAT_TRACE_DROPPED,     // Captured requests that did not fit into the capture ring
+    STAT_COUNTERS,
+} stat_counter_t;
+
+const char *stat_counter_names[STAT_COUNTERS] = {
+    "accepted",
+    "accept_deferred",
+    "requests_add",
+    "requests_subtract",
+    "requests_multiply",
+    "requests_divide",
+    "requests_unknown",
+    "batches",
+    "expressions",
+    "expression_tuples",
+    "division_by_zero",
+    "malformed",
+    "partial_frames",
+    "idle_timeouts",
+    "datagrams_received",
+    "datagrams_dropped",
+    "trace_dropped",
+};
+
+typedef enum
+{
+    STAT_READ,    // One read or recvmmsg call
+    STAT_COMPUTE, // Computing the requests of one wakeup of a connection (or one request in the worker pool)
+    STAT_WRITE,   // One flush of a connection or sendmmsg call
+    STAT_HISTOGRAMS,
+} stat_histogram_t;
+
+const char *stat_histogram_names[STAT_HISTOGRAMS] = {"read", "compute", "write"};
+
+typedef struct
+{
+    _Alignas(64) uint64_t counters[STAT_COUNTERS];
+    histogram_t histograms[STAT_HISTOGRAMS]; // Nanoseconds
+} server_stats_t;
+
+/// @brief Statistics of the calling reactor thread
+__thread server_stats_t *thread_stats;
+
+server_stats_t *stats_create(void)
+{
+    server_stats_t *stats = aligned_alloc(64, sizeof(server_stats_t));
+    if (NULL == stats)
+        ERR("aligned_alloc");
+    memset(stats->counters, 0, sizeof(stats->counters));
+    for (int i = 0; i < STAT_HISTOGRAMS; i++)
+        histogram_init(&stats->histograms[i]);
+    return stats;
+}
+
+/// @brief Monotonic time in nanoseconds
+uint64_t stats_clock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/// @brief Add to a counter of the calling thread
+void stats_count(stat_counter_t counter, uint64_t n)
+{
+    uint64_t *value = &thread_stats->counters[counter];
+    __atomic_store_n(value, *value + n, __ATOMIC_RELAXED);
+}
+
+/// @brief Record the time elapsed since start in a histogram of the calling thread
+/// @param histogram Histogram
+/// @param start Value of stats_clock at the beginning of the measured operation
+/// @return Current time, to chain measurements
+uint64_t stats_record(stat_histogram_t histogram, uint64_t start)
+{
+    uint64_t now = stats_clock();
+    histogram_record(&thread_stats->histograms[histogram], now - start);
+    return now;
+}
+
+/// @brief Count one operation by its operator
+/// @param operation Operation
+/// @param operand2 Second operand (host byte order)
+void stats_count_operation(char operation, int64_t operand2)
+{
+    switch (operation)
+    {
+        case '+':
+            stats_count(STAT_REQUESTS_ADD, 1);
+            break;
+        case '-':
+            stats_count(STAT_REQUESTS_SUBTRACT, 1);
+            break;
+        case '*':
+            stats_count(STAT_REQUESTS_MULTIPLY, 1);
+            break;
+        case '/':
+            stats_count(STAT_REQUESTS_DIVIDE, 1);
+            if (0 == operand2)
+                stats_count(STAT_DIVISION_BY_ZERO, 1);
+            break;
+        default:
+            stats_count(STAT_REQUESTS_UNKNOWN, 1);
+    }
+}
+
+/// @brief Count a complete request before it is computed
+/// @param data Request (network byte order)
+void stats_count_request(const int32_t *data)
+{
+    if (OPERATION_EXPRESSION == (char)ntohl(data[OPERATION_INDEX]))
+    {
+        stats_count(STAT_EXPRESSIONS, 1);
+        stats_count(STAT_EXPRESSION_TUPLES, ntohl(data[OPERAND1_INDEX]));
+        return;
+    }
+    if (OPERATION_BATCH != (char)ntohl(data[OPERATION_INDEX]))
+    {
+        stats_count_operation((char)ntohl(data[OPERATION_INDEX]), ntohl(data[OPERAND2_INDEX]));
+        return;
+    }
+    int32_t count = ntohl(data[OPERAND1_INDEX]);
+    const int32_t *operand2 = data + MESSAGE_SIZE + count, *operation = data + MESSAGE_SIZE + 2 * count;
+    stats_count(STAT_BATCHES, 1);
+    for (int32_t i = 0; i < count; i++)
+        stats_count_operation((char)ntohl(operation[i]), ntohl(operand2[i]));
+}
+
+/// @brief Add the statistics of a reactor to a total
+/// @param destination Statistics owned by the calling thread
+/// @param source Statistics of a reactor (may be written concurrently)
+void stats_merge(server_stats_t *destination, const server_stats_t *source)
+{
+    for (int i = 0; i < STAT_COUNTERS; i++)
+        destination->counters[i] += __atomic_load_n(&source->counters[i], __ATOMIC_RELAXED);
+    for (int i = 0; i < STAT_HISTOGRAMS; i++)
+        histogram_merge(&destination->histograms[i], &source->histograms[i]);
+}
+
+/// @brief Print statistics as "<name>.<key> <value>" lines, latencies in nanoseconds
+/// @param out Output stream
+/// @param name Prefix of the lines
+/// @param stats Statistics (not written concurrently, merge them first)
+void stats_print(FILE *out, const char *name, const server_stats_t *stats)
+{
+    for (int i = 0; i < STAT_COUNTERS; i++)
+        fprintf(out, "%s.%s %" PRIu64 "\n", name, stat_counter_names[i], stats->counters[i]);
+    for (int i = 0; i < STAT_HISTOGRAMS; i++)
+    {
+        const histogram_t *histogram = &stats->histograms[i];
+        fprintf(out,
+                "%s.%s_ns count %" PRIu64 " mean %.0f p50 %" PRIu64 " p99 %" PRIu64 " p99.9 %" PRIu64 " max %" PRIu64
+                "\n",
+                name, stat_histogram_names[i], histogram->count, histogram_mean(histogram),
+                histogram_quantile(histogram, 0.5), histogram_quantile(histogram, 0.99),
+                histogram_quantile(histogram, 0.999), histogram->max);
+    }
+}
+
+#endif // SOCKETS_STATS_H
@@ -0,0 +1,121 @@
+//
+// Hashed timer wheel for the idle timeouts of the calculator server.
+//
+// Time is cut into ticks of TIMER_WHEEL_TICK_MS; a timer expiring at tick t sits in the intrusive list of slot
+// t % TIMER_WHEEL_SLOTS, so arming, re-arming and cancelling are O(1) list operations. Timers further away than
+// one revolution of the wheel share the slot with nearer ones and are skipped until their tick comes. The owner
+// of the wheel advances it with the current time after every wakeup and sleeps at most until the next tick.
+//
+
+#ifndef SOCKETS_TIMER_WHEEL_H
+#define SOCKETS_TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_WHEEL_SLOTS 1024 // A power of two
+#define TIMER_WHEEL_TICK_MS 100
+
+typedef struct wheel_timer
+{
+    struct wheel_timer *next, *prev; // NULL when the timer is not armed
+    uint64_t expires;                // Tick at which the timer fires
+} wheel_timer_t;
+
+typedef struct
+{
+    wheel_timer_t slots[TIMER_WHEEL_SLOTS]; // Sentinels of circular lists
+    uint64_t current;                       // Last tick processed
+    size_t armed;                           // Number of armed timers
+} timer_wheel_t;
+
+/// @brief Initialize a wheel
+/// @param wheel Wheel
+/// @param now_ms Current time in milliseconds
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now_ms)
+{
+    for (int i = 0; i < TIMER_WHEEL_SLOTS; i++)
+        wheel->slots[i].next = wheel->slots[i].prev = &wheel->slots[i];
+    wheel->current = now_ms / TIMER_WHEEL_TICK_MS;
+    wheel->armed = 0;
+}
+
+void wheel_timer_init(wheel_timer_t *timer)
+{
+    timer->next = timer->prev = NULL;
+}
+
+/// @brief Stop a timer, does nothing if it is not armed
+void timer_wheel_cancel(timer_wheel_t *wheel, wheel_timer_t *timer)
+{
+    if (NULL == timer->next)
+        return;
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+    wheel->armed--;
+}
+
+/// @brief Arm (or re-arm) a timer to fire after at least the given number of milliseconds
+/// @param wheel Wheel
+/// @param timer Timer
+/// @param timeout_ms Timeout, rounded up to whole ticks
+void timer_wheel_arm(timer_wheel_t *wheel, wheel_timer_t *timer, uint64_t timeout_ms)
+{
+    // The current tick has partly elapsed already, so count one more
+    uint64_t expires = wheel->current + (timeout_ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS + 1;
+    if (timer->next && timer->expires == expires)
+        return; // Re-armed within the same tick, nothing moves
+    timer_wheel_cancel(wheel, timer);
+    wheel_timer_t *slot = &wheel->slots[expires & (TIMER_WHEEL_SLOTS - 1)];
+    timer->expires = expires;
+    timer->next = slot->next;
+    timer->prev = slot;
+    slot->next->prev = timer;
+    slot->next = timer;
+    wheel->armed++;
+}
+
+/// @brief Fire every timer that expired up to the given time
+/// @param wheel Wheel
+/// @param now_ms Current time in milliseconds
+/// @param expire Called with every expired timer, which is already disarmed (it may arm it again or free it)
+/// @param arg Passed to expire
+void timer_wheel_advance(timer_wheel_t *wheel, uint64_t now_ms, void (*expire)(wheel_timer_t *, void *), void *arg)
+{
+    uint64_t target = now_ms / TIMER_WHEEL_TICK_MS;
+    // After a long stall, a single revolution visits every slot, the timers compare against the current tick
+    if (target > wheel->current + TIMER_WHEEL_SLOTS)
+        wheel->current = target - TIMER_WHEEL_SLOTS;
+    while (wheel->current < target && wheel->armed > 0)
+    {
+        wheel->current++;
+        wheel_timer_t *slot = &wheel->slots[wheel->current & (TIMER_WHEEL_SLOTS - 1)];
+        wheel_timer_t *timer = slot->next;
+        while (timer != slot)
+        {
+            wheel_timer_t *next = timer->next;
+            if (timer->expires <= wheel->current)
+            {
+                timer_wheel_cancel(wheel, timer);
+                expire(timer, arg);
+            }
+            timer = next;
+        }
+    }
+    wheel->current = target > wheel->current ? target : wheel->current;
+}
+
+/// @brief Time the owner of the wheel may sleep before it has to advance the wheel again
+/// @param wheel Wheel
+/// @param now_ms Current time in milliseconds
+/// @return Timeout in milliseconds, -1 if no timer is armed
+int timer_wheel_timeout(const timer_wheel_t *wheel, uint64_t now_ms)
+{
+    if (0 == wheel->armed)
+        return -1;
+    uint64_t next_tick_ms = (wheel->current + 1) * TIMER_WHEEL_TICK_MS;
+    return next_tick_ms > now_ms ? (int)(next_tick_ms - now_ms) : 0;
+}
+
+#endif // SOCKETS_TIMER_WHEEL_H
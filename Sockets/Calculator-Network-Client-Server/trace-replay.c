@@ -0,0 +1,434 @@
+//
+// Replay of the requests captured by the calculator server (server -c).
+//
+// Every captured stream connection gets its own connection to the target server, and its requests are sent at
+// the pace they were captured at (scaled by the speed factor, or as fast as the server takes them). A captured
+// close shuts the connection down once its requests are sent. Replies are read and discarded: the replay drives
+// the server the way the captured clients did, the server statistics and the load generator measure it.
+//
+
+#include "socklib.h"
+#include "trace.h"
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define MAX_BACKLOG (64 * 1024) // Bytes queued at most on a connection before the replay waits for the server
+
+typedef struct
+{
+    // Records are packed back to back in the file, so their headers are copied out rather than read in place
+    trace_record_t record;
+    const char *request;
+    size_t order; // Position in the file, keeps the records of equal timestamps in order
+} replay_record_t;
+
+typedef struct
+{
+    uint32_t id;
+    int fd;       // -1 before the first request and once the server closed the connection
+    int shutdown; // Whether the capture saw the connection close
+    int done;     // Whether the writing side was shut down
+    char *out;
+    size_t out_length, out_capacity;
+} replay_connection_t;
+
+typedef struct
+{
+    char *local_name, *address, *port, *dgram_name;
+    int local_dgram_fd, udp_fd;
+    replay_connection_t *connections;
+    size_t n_connections;
+    uint64_t bytes_sent, bytes_received, skipped;
+} replay_t;
+
+void usage(char *name)
+{
+    fprintf(stderr, "Usage: %s [-x speed] [-l local socket name] [-a server address] [-p port] [-d datagram socket name] <trace file>\n", name);
+    fprintf(stderr, "  speed: factor applied to the captured pace, 0 to send as fast as the server takes it (default 1)\n");
+    fprintf(stderr, "  -l: replay the requests of local connections on this local socket\n");
+    fprintf(stderr, "  -a, -p: replay the requests of TCP connections and UDP datagrams on this server\n");
+    fprintf(stderr, "  -d: replay the local datagrams on this local datagram socket\n");
+    fprintf(stderr, "  requests of a transport without a target are skipped\n");
+    exit(EXIT_FAILURE);
+}
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int compare_records(const void *a, const void *b)
+{
+    const replay_record_t *x = a, *y = b;
+    if (x->record.timestamp_ns != y->record.timestamp_ns)
+        return x->record.timestamp_ns < y->record.timestamp_ns ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+int compare_connections(const void *a, const void *b)
+{
+    const replay_connection_t *x = a, *y = b;
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+/// @brief Index the records of a mapped trace, sorted by timestamp
+/// @param data Trace file
+/// @param size Size of the file
+/// @param n_records Set to the number of records
+/// @return Records
+replay_record_t *index_records(const char *data, size_t size, size_t *n_records)
+{
+    const trace_header_t *header = (const trace_header_t *)data;
+    if (size < sizeof(trace_header_t) || memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) ||
+        TRACE_VERSION != header->version)
+    {
+        fprintf(stderr, "Not a trace file\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t capacity = 1024, count = 0;
+    replay_record_t *records = malloc(capacity * sizeof(replay_record_t));
+    if (NULL == records)
+        ERR("malloc");
+    for (size_t offset = sizeof(trace_header_t); offset < size;)
+    {
+        trace_record_t record;
+        if (size - offset >= sizeof(trace_record_t))
+            memcpy(&record, data + offset, sizeof(record));
+        if (size - offset < sizeof(trace_record_t) || size - offset - sizeof(trace_record_t) < record.size)
+        {
+            fprintf(stderr, "Trace file truncated, replaying the first %zu records\n", count);
+            break;
+        }
+        if (count == capacity && NULL == (records = realloc(records, (capacity *= 2) * sizeof(replay_record_t))))
+            ERR("realloc");
+        records[count].record = record;
+        records[count].request = data + offset + sizeof(trace_record_t);
+        records[count].order = count;
+        count++;
+        offset += sizeof(trace_record_t) + record.size;
+    }
+    qsort(records, count, sizeof(replay_record_t), compare_records);
+    *n_records = count;
+    return records;
+}
+
+/// @brief Create the state of every stream connection of the trace, sorted by id
+void index_connections(replay_t *replay, replay_record_t *records, size_t n_records)
+{
+    replay->connections = calloc(n_records > 0 ? n_records : 1, sizeof(replay_connection_t));
+    if (NULL == replay->connections)
+        ERR("calloc");
+    size_t count = 0;
+    for (size_t i = 0; i < n_records; i++)
+        if (0 != records[i].record.connection)
+            replay->connections[count++].id = records[i].record.connection;
+    qsort(replay->connections, count, sizeof(replay_connection_t), compare_connections);
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++)
+        if (0 == unique || replay->connections[unique - 1].id != replay->connections[i].id)
+            replay->connections[unique++].id = replay->connections[i].id;
+    for (size_t i = 0; i < unique; i++)
+        replay->connections[i].fd = -1;
+    replay->n_connections = unique;
+}
+
+replay_connection_t *find_connection(replay_t *replay, uint32_t id)
+{
+    replay_connection_t key = {.id = id};
+    return bsearch(&key, replay->connections, replay->n_connections, sizeof(replay_connection_t),
+                   compare_connections);
+}
+
+/// @brief Close the connection, the server closed it or the replay is done with it
+void close_connection(replay_connection_t *connection)
+{
+    if (TEMP_FAILURE_RETRY(close(connection->fd)) < 0)
+        ERR("close");
+    connection->fd = -1;
+    connection->done = 1;
+    connection->out_length = 0;
+}
+
+/// @brief Write the queued requests of a connection without blocking, then shut it down if the capture did
+void flush_connection(replay_t *replay, replay_connection_t *connection)
+{
+    if (connection->out_length > 0)
+    {
+        ssize_t c = TEMP_FAILURE_RETRY(write(connection->fd, connection->out, connection->out_length));
+        if (c < 0)
+        {
+            if (EAGAIN == errno || EWOULDBLOCK == errno)
+                return;
+            if (EPIPE != errno && ECONNRESET != errno)
+                ERR("write");
+            close_connection(connection);
+            return;
+        }
+        replay->bytes_sent += c;
+        connection->out_length -= c;
+        memmove(connection->out, connection->out + c, connection->out_length);
+    }
+    if (0 == connection->out_length && connection->shutdown && !connection->done)
+    {
+        if (shutdown(connection->fd, SHUT_WR) < 0 && ENOTCONN != errno)
+            ERR("shutdown");
+        connection->done = 1;
+    }
+}
+
+/// @brief Read and discard the replies of a connection
+void drain_connection(replay_t *replay, replay_connection_t *connection)
+{
+    char buffer[4096];
+    for (;;)
+    {
+        ssize_t c = TEMP_FAILURE_RETRY(read(connection->fd, buffer, sizeof(buffer)));
+        if (c < 0 && (EAGAIN == errno || EWOULDBLOCK == errno))
+            return;
+        if (c < 0 && ECONNRESET != errno)
+            ERR("read");
+        if (c <= 0)
+        {
+            close_connection(connection);
+            return;
+        }
+        replay->bytes_received += c;
+    }
+}
+
+/// @brief Read and discard the replies to datagrams
+void drain_datagrams(replay_t *replay, int fd)
+{
+    char buffer[65536];
+    ssize_t c;
+    while ((c = TEMP_FAILURE_RETRY(recv(fd, buffer, sizeof(buffer), 0))) > 0)
+        replay->bytes_received += c;
+    if (c < 0 && EAGAIN != errno && EWOULDBLOCK != errno && ECONNREFUSED != errno)
+        ERR("recv");
+}
+
+/// @brief Send a record, or queue it on its connection
+/// @return 0 if the record was handled, -1 if its connection has too much queued to take it yet
+int replay_record(replay_t *replay, const replay_record_t *entry)
+{
+    const trace_record_t *record = &entry->record;
+    const char *request = entry->request;
+    if (TRACE_UDP == record->transport || TRACE_LOCAL_DATAGRAM == record->transport)
+    {
+        int fd = TRACE_UDP == record->transport ? replay->udp_fd : replay->local_dgram_fd;
+        if (fd < 0)
+        {
+            replay->skipped++;
+            return 0;
+        }
+        // A datagram the socket does not take right now is lost, as it could have been for the captured client
+        if (TEMP_FAILURE_RETRY(send(fd, request, record->size, 0)) < 0)
+        {
+            if (EAGAIN != errno && EWOULDBLOCK != errno && ECONNREFUSED != errno)
+                ERR("send");
+            replay->skipped++;
+        }
+        else
+            replay->bytes_sent += record->size;
+        return 0;
+    }
+
+    replay_connection_t *connection = find_connection(replay, record->connection);
+    char *name = TRACE_LOCAL == record->transport ? replay->local_name : replay->address;
+    if (NULL == name || connection->done)
+    {
+        replay->skipped++;
+        return 0;
+    }
+    if (0 == record->size)
+    {
+        connection->shutdown = 1;
+        if (connection->fd >= 0)
+            flush_connection(replay, connection);
+        else
+            connection->done = 1; // Closed without a request, nothing to replay
+        return 0;
+    }
+    if (connection->out_length >= MAX_BACKLOG)
+        return -1;
+    if (connection->fd < 0)
+    {
+        connection->fd = TRACE_LOCAL == record->transport ? connect_local_socket(name)
+                                                          : connect_tcp_socket(name, replay->port);
+        make_nonblocking(connection->fd);
+    }
+    if (connection->out_length + record->size > connection->out_capacity)
+    {
+        connection->out_capacity = 2 * (connection->out_length + record->size);
+        if (NULL == (connection->out = realloc(connection->out, connection->out_capacity)))
+            ERR("realloc");
+    }
+    memcpy(connection->out + connection->out_length, request, record->size);
+    connection->out_length += record->size;
+    flush_connection(replay, connection);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    replay_t replay = {.local_dgram_fd = -1, .udp_fd = -1};
+    double speed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "x:l:a:p:d:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'x':
+                if ((speed = atof(optarg)) < 0)
+                    usage(argv[0]);
+                break;
+            case 'l':
+                replay.local_name = optarg;
+                break;
+            case 'a':
+                replay.address = optarg;
+                break;
+            case 'p':
+                replay.port = optarg;
+                break;
+            case 'd':
+                replay.dgram_name = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1 || (NULL == replay.address) != (NULL == replay.port))
+        usage(argv[0]);
+
+    sethandler(SIG_IGN, SIGPIPE); // Ignore SIGPIPE
+
+    // Map the trace and sort its records, the reactors of the server wrote them in batches
+    int trace_fd = TEMP_FAILURE_RETRY(open(argv[optind], O_RDONLY | O_CLOEXEC));
+    if (trace_fd < 0)
+        ERR("open");
+    struct stat st;
+    if (fstat(trace_fd, &st) < 0)
+        ERR("fstat");
+    char *data = mmap(NULL, st.st_size > 0 ? st.st_size : 1, PROT_READ, MAP_PRIVATE, trace_fd, 0);
+    if (MAP_FAILED == data)
+        ERR("mmap");
+    size_t n_records;
+    replay_record_t *records = index_records(data, st.st_size, &n_records);
+    index_connections(&replay, records, n_records);
+
+    if (replay.address)
+    {
+        replay.udp_fd = connect_udp_socket(replay.address, replay.port);
+        make_nonblocking(replay.udp_fd);
+    }
+    if (replay.dgram_name)
+    {
+        replay.local_dgram_fd = connect_local_dgram_socket(replay.dgram_name);
+        make_nonblocking(replay.local_dgram_fd);
+    }
+
+    struct pollfd *fds = calloc(replay.n_connections + 2, sizeof(struct pollfd));
+    replay_connection_t **polled = calloc(replay.n_connections, sizeof(replay_connection_t *));
+    if (NULL == fds || NULL == polled)
+        ERR("calloc");
+
+    uint64_t start = now_ns(), max_lag = 0;
+    size_t next = 0;
+    for (;;)
+    {
+        // Send every record that is due, in order
+        uint64_t now = now_ns(), due = now;
+        for (; next < n_records; next++)
+        {
+            due = start + (speed > 0 ? (uint64_t)(records[next].record.timestamp_ns / speed) : 0);
+            if (due > now || replay_record(&replay, &records[next]) < 0)
+                break;
+            if (now - due > max_lag)
+                max_lag = now - due;
+        }
+
+        // Watch the open connections, shutting down the ones left open once every record was sent
+        nfds_t n_fds = 0;
+        for (size_t i = 0; i < replay.n_connections; i++)
+        {
+            replay_connection_t *connection = &replay.connections[i];
+            if (connection->fd < 0)
+                continue;
+            if (next == n_records && !connection->shutdown)
+            {
+                connection->shutdown = 1;
+                flush_connection(&replay, connection);
+                if (connection->fd < 0)
+                    continue;
+            }
+            polled[n_fds] = connection;
+            fds[n_fds].fd = connection->fd;
+            fds[n_fds++].events = POLLIN | (connection->out_length > 0 ? POLLOUT : 0);
+        }
+        if (next == n_records && 0 == n_fds)
+            break;
+        nfds_t n_streams = n_fds;
+        int datagram_fds[2] = {replay.udp_fd, replay.local_dgram_fd};
+        for (int i = 0; i < 2; i++)
+            if (datagram_fds[i] >= 0)
+            {
+                fds[n_fds].fd = datagram_fds[i];
+                fds[n_fds++].events = POLLIN;
+            }
+
+        // Wait for the server, but not past the next record
+        struct timespec timeout = {0, 0}, *wait = NULL;
+        if (next < n_records && due > now)
+        {
+            timeout.tv_sec = (due - now) / 1000000000ull;
+            timeout.tv_nsec = (due - now) % 1000000000ull;
+        }
+        if (next < n_records && (due > now || 0 == n_streams))
+            wait = &timeout;
+        if (ppoll(fds, n_fds, wait, NULL) < 0 && EINTR != errno)
+            ERR("ppoll");
+
+        for (nfds_t i = 0; i < n_streams; i++)
+        {
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                drain_connection(&replay, polled[i]);
+            if (polled[i]->fd >= 0 && fds[i].revents & POLLOUT)
+                flush_connection(&replay, polled[i]);
+        }
+        for (nfds_t i = n_streams; i < n_fds; i++)
+            if (fds[i].revents & POLLIN)
+                drain_datagrams(&replay, fds[i].fd);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("Replayed: %" PRIu64 " records of %zu connection(s) in %.3f s (%" PRIu64 " skipped)\n",
+           n_records - replay.skipped, replay.n_connections, elapsed, replay.skipped);
+    if (n_records > 0)
+        printf("Captured over: %.3f s\n", records[n_records - 1].record.timestamp_ns / 1e9);
+    printf("Rate: %.0f records/s\n", elapsed > 0 ? (n_records - replay.skipped) / elapsed : 0);
+    printf("Bytes: sent %" PRIu64 ", received %" PRIu64 "\n", replay.bytes_sent, replay.bytes_received);
+    if (speed > 0)
+        printf("Max lag behind the schedule: %.3f ms\n", max_lag / 1e6);
+
+    for (size_t i = 0; i < replay.n_connections; i++)
+        free(replay.connections[i].out);
+    free(replay.connections);
+    free(polled);
+    free(fds);
+    free(records);
+    if ((replay.udp_fd >= 0 && TEMP_FAILURE_RETRY(close(replay.udp_fd)) < 0) ||
+        (replay.local_dgram_fd >= 0 && TEMP_FAILURE_RETRY(close(replay.local_dgram_fd)) < 0))
+        ERR("close");
+    if (munmap(data, st.st_size > 0 ? st.st_size : 1) < 0)
+        ERR("munmap");
+    if (TEMP_FAILURE_RETRY(close(trace_fd)) < 0)
+        ERR("close");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,191 @@
+//
+// Request capture of the calculator server, replayed by trace-replay.
+//
+// A trace file is a trace_header_t followed by records: a trace_record_t and the request exactly as it was framed
+// (a version 1 frame, a batch or expression frame, or a version 2 request), in the byte order of the capturing
+// host. A record without a request tells that a stream connection was closed. Negotiation frames are captured
+// like any request, so a replay speaks the same protocol versions; requests of the shared-memory rings are
+// captured as requests of their local connection.
+//
+// Reactors never touch the file: every reactor appends its records to its own single-producer ring, and a
+// background writer thread drains the rings into the file every few milliseconds. A record that does not fit
+// into a full ring is dropped (and counted), so capturing never stalls the event loops. Records of different
+// reactors reach the file in batches; the replay sorts them by timestamp.
+//
+
+#ifndef SOCKETS_TRACE_H
+#define SOCKETS_TRACE_H
+
+#include "socklib.h"
+#include "stats.h"
+#include <pthread.h>
+
+#define TRACE_MAGIC "CALCTRC"
+#define TRACE_VERSION 1
+#define TRACE_RING_SIZE (4 << 20) // Bytes per reactor, a power of two
+#define TRACE_FLUSH_MS 10         // Time the writer sleeps when the rings are empty
+
+typedef enum
+{
+    TRACE_TCP,
+    TRACE_LOCAL,
+    TRACE_UDP,
+    TRACE_LOCAL_DATAGRAM,
+} trace_transport_t;
+
+typedef struct
+{
+    char magic[8]; // TRACE_MAGIC
+    uint32_t version;
+    uint32_t reserved;
+} trace_header_t;
+
+typedef struct
+{
+    uint64_t timestamp_ns; // Since the capture started
+    uint32_t connection;   // Id of the stream connection, 0 for datagrams
+    uint8_t transport;     // trace_transport_t
+    uint8_t reserved;
+    uint16_t size; // Size of the request following the record, 0 if the connection was closed
+} trace_record_t;
+
+typedef struct
+{
+    _Alignas(64) size_t head; // Written by the writer only
+    _Alignas(64) size_t tail; // Written by the owning reactor only
+    char *buffer;
+} trace_ring_t;
+
+typedef struct
+{
+    int fd;
+    int n_rings;
+    trace_ring_t *rings;
+    int stop;
+    uint64_t bytes_written;
+    pthread_t thread;
+} trace_writer_t;
+
+/// @brief Capture ring of the calling reactor thread, NULL if requests are not captured
+__thread trace_ring_t *thread_trace;
+uint64_t trace_start_ns;
+
+/// @brief Id of the next stream connection, ids start at 1
+uint32_t next_connection_id;
+
+/// @brief Copy bytes into a ring, wrapping around its end
+void trace_ring_copy(trace_ring_t *ring, size_t position, const void *data, size_t size)
+{
+    size_t offset = position & (TRACE_RING_SIZE - 1), first = TRACE_RING_SIZE - offset;
+    if (first > size)
+        first = size;
+    memcpy(ring->buffer + offset, data, first);
+    memcpy(ring->buffer, (const char *)data + first, size - first);
+}
+
+/// @brief Capture a request framed by the calling reactor
+/// @param transport Transport the request arrived on
+/// @param connection Id of the connection, 0 for datagrams
+/// @param data Request, before it is computed in place
+/// @param size Size of the request, 0 to capture that the connection was closed
+void trace_request(trace_transport_t transport, uint32_t connection, const void *data, size_t size)
+{
+    trace_ring_t *ring = thread_trace;
+    if (NULL == ring)
+        return;
+    trace_record_t record = {stats_clock() - trace_start_ns, connection, transport, 0, size};
+    size_t tail = ring->tail;
+    if (TRACE_RING_SIZE - (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) < sizeof(record) + size)
+    {
+        stats_count(STAT_TRACE_DROPPED, 1);
+        return;
+    }
+    trace_ring_copy(ring, tail, &record, sizeof(record));
+    if (size > 0)
+        trace_ring_copy(ring, tail + sizeof(record), data, size);
+    __atomic_store_n(&ring->tail, tail + sizeof(record) + size, __ATOMIC_RELEASE);
+}
+
+/// @brief Write whatever the reactors appended to their rings
+/// @return Number of bytes written
+size_t trace_writer_drain(trace_writer_t *writer)
+{
+    size_t written = 0;
+    for (int i = 0; i < writer->n_rings; i++)
+    {
+        trace_ring_t *ring = &writer->rings[i];
+        size_t head = ring->head, tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            size_t offset = head & (TRACE_RING_SIZE - 1), size = tail - head;
+            if (size > TRACE_RING_SIZE - offset)
+                size = TRACE_RING_SIZE - offset;
+            if (bulk_write(writer->fd, ring->buffer + offset, size) < 0)
+                ERR("write");
+            head += size;
+            written += size;
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+    writer->bytes_written += written;
+    return written;
+}
+
+void *trace_writer_work(void *args)
+{
+    trace_writer_t *writer = args;
+    struct timespec idle = {0, TRACE_FLUSH_MS * 1000000L};
+    for (;;)
+    {
+        // Everything appended before the stop was requested is drained once more
+        int stop = __atomic_load_n(&writer->stop, __ATOMIC_ACQUIRE);
+        size_t written = trace_writer_drain(writer);
+        if (stop)
+            return NULL;
+        if (0 == written)
+            nanosleep(&idle, NULL);
+    }
+}
+
+/// @brief Create the trace file and start the writer
+/// @param path Trace file, truncated if it exists
+/// @param n_rings Number of reactors, each gets the ring writer->rings[id]
+/// @return Writer
+trace_writer_t *trace_writer_start(const char *path, int n_rings)
+{
+    trace_writer_t *writer = calloc(1, sizeof(trace_writer_t));
+    if (NULL == writer || NULL == (writer->rings = calloc(n_rings, sizeof(trace_ring_t))))
+        ERR("calloc");
+    writer->n_rings = n_rings;
+    for (int i = 0; i < n_rings; i++)
+        if (NULL == (writer->rings[i].buffer = malloc(TRACE_RING_SIZE)))
+            ERR("malloc");
+    if ((writer->fd = TEMP_FAILURE_RETRY(open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644))) < 0)
+        ERR("open");
+    trace_header_t header = {TRACE_MAGIC, TRACE_VERSION, 0};
+    if (bulk_write(writer->fd, (char *)&header, sizeof(header)) < 0)
+        ERR("write");
+    trace_start_ns = stats_clock();
+    if (pthread_create(&writer->thread, NULL, trace_writer_work, writer))
+        ERR("pthread_create");
+    return writer;
+}
+
+/// @brief Write the remaining records and close the trace file, the reactors must be done
+/// @return Number of bytes written to the trace file, header excluded
+uint64_t trace_writer_stop(trace_writer_t *writer)
+{
+    __atomic_store_n(&writer->stop, 1, __ATOMIC_RELEASE);
+    if (pthread_join(writer->thread, NULL))
+        ERR("pthread_join");
+    if (TEMP_FAILURE_RETRY(close(writer->fd)) < 0)
+        ERR("close");
+    for (int i = 0; i < writer->n_rings; i++)
+        free(writer->rings[i].buffer);
+    uint64_t written = writer->bytes_written;
+    free(writer->rings);
+    free(writer);
+    return written;
+}
+
+#endif // SOCKETS_TRACE_H
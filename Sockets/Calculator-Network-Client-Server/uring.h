@@ -0,0 +1,227 @@
+//
+// Minimal io_uring plumbing on top of the raw system calls (no liburing dependency).
+//
+// A ring is set up with a single mmap of the submission/completion rings, submission queue entries are
+// filled in user space and handed to the kernel in batches with one io_uring_enter call, which also waits
+// for the next completions.
+//
+
+#ifndef SOCKETS_URING_H
+#define SOCKETS_URING_H
+
+#include "socklib.h"
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+typedef struct
+{
+    int fd;
+    unsigned features;
+
+    // Submission queue
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries, sq_pending;
+    struct io_uring_sqe *sqes;
+
+    // Completion queue
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *ring;
+    size_t ring_size, sqes_size;
+} uring_t;
+
+int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/// @brief Create a ring and map its queues
+/// @param ring Ring to initialize
+/// @param entries Number of submission queue entries
+/// @return 0 on success, -1 if io_uring is not available (errno is set)
+int uring_init(uring_t *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = 4 * entries;
+    if ((ring->fd = uring_setup(entries, &params)) < 0)
+        return -1;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    ring->features = params.features;
+
+    // The submission and completion rings share one mapping, the entries live in a second one
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQ_RING);
+    if (MAP_FAILED == ring->ring)
+        ERR("mmap");
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (MAP_FAILED == ring->sqes)
+        ERR("mmap");
+
+    char *base = ring->ring;
+    ring->sq_head = (unsigned *)(base + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(base + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(base + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(base + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_pending = 0;
+    ring->cq_head = (unsigned *)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(base + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+    return 0;
+}
+
+/// @brief Unmap the queues and close the ring
+void uring_destroy(uring_t *ring)
+{
+    if (munmap(ring->sqes, ring->sqes_size) < 0 || munmap(ring->ring, ring->ring_size) < 0)
+        ERR("munmap");
+    if (TEMP_FAILURE_RETRY(close(ring->fd)) < 0)
+        ERR("close");
+}
+
+/// @brief Hand every prepared submission to the kernel and wait for completions
+/// @param ring Ring
+/// @param wait_for Minimal number of completions to wait for
+void uring_submit(uring_t *ring, unsigned wait_for)
+{
+    unsigned flags = wait_for ? IORING_ENTER_GETEVENTS : 0;
+    while (ring->sq_pending > 0 || wait_for > 0)
+    {
+        int c = uring_enter(ring->fd, ring->sq_pending, wait_for, flags);
+        if (c < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            ERR("io_uring_enter");
+        }
+        ring->sq_pending -= c;
+        wait_for = 0;
+    }
+}
+
+/// @brief Get a cleared submission queue entry, submitting the queue first if it is full
+/// @param ring Ring
+/// @return Submission queue entry, queued on return
+struct io_uring_sqe *uring_get_sqe(uring_t *ring)
+{
+    unsigned tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    {
+        uring_submit(ring, 0);
+        tail = *ring->sq_tail;
+    }
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->sq_pending++;
+    return sqe;
+}
+
+/// @brief Get the next completion without waiting
+/// @param ring Ring
+/// @return Completion queue entry (released with uring_cqe_seen) or NULL if there is none
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring)
+{
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/// @brief Register fixed buffers, so reads and writes to them skip the per-request page pinning
+/// @return 0 on success, -1 on failure (e.g. the RLIMIT_MEMLOCK is too small)
+int uring_register_buffers(uring_t *ring, struct iovec *iovecs, unsigned count)
+{
+    return uring_register(ring->fd, IORING_REGISTER_BUFFERS, iovecs, count) < 0 ? -1 : 0;
+}
+
+/*
+ * Submission helpers
+ */
+
+void uring_prep_multishot_accept(struct io_uring_sqe *sqe, int fd, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+}
+
+/// @brief Prepare a read or write of a buffer, a fixed one if buffer_index is not negative
+void uring_prep_rw(struct io_uring_sqe *sqe, int opcode, int fd, void *buf, unsigned len, int buffer_index,
+                   uint64_t user_data)
+{
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = -1; // Current file position, sockets do not have one
+    if (buffer_index >= 0)
+        sqe->buf_index = buffer_index;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_poll(struct io_uring_sqe *sqe, int fd, uint32_t events, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = user_data;
+}
+
+/// @brief Prepare the cancellation of the operation submitted with the given user data (multishot ones included)
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t target, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+}
+
+/// @brief Prepare a timeout that completes with -ETIME once the time has elapsed
+/// @param timeout Relative timeout, must stay valid until the completion
+void uring_prep_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *timeout, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)timeout;
+    sqe->len = 1;
+    sqe->user_data = user_data;
+}
+
+#endif // SOCKETS_URING_H
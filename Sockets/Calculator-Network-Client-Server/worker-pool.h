@@ -0,0 +1,243 @@
+//
+// Bounded worker pool for the calculator server.
+//
+// Reactors push jobs into a lock-free multi-producer multi-consumer queue (Vyukov's bounded queue: every cell
+// carries a sequence number telling producers and consumers whose turn it is). Idle workers sleep on a semaphore.
+// A finished job is pushed into the completion queue named by the job, and the owning reactor is woken through
+// the eventfd of that queue, only if it was not signalled already since it last drained the queue.
+//
+
+#ifndef SOCKETS_WORKER_POOL_H
+#define SOCKETS_WORKER_POOL_H
+
+#include "socklib.h"
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+
+#define CACHE_LINE_SIZE 64
+
+typedef struct
+{
+    size_t sequence;
+    void *value;
+} mpmc_cell_t;
+
+typedef struct
+{
+    mpmc_cell_t *cells;
+    size_t mask;
+    _Alignas(CACHE_LINE_SIZE) size_t enqueue_position;
+    _Alignas(CACHE_LINE_SIZE) size_t dequeue_position;
+} mpmc_queue_t;
+
+/// @brief Initialize a queue
+/// @param queue Queue
+/// @param capacity Number of cells, a power of two
+void mpmc_init(mpmc_queue_t *queue, size_t capacity)
+{
+    if (NULL == (queue->cells = malloc(capacity * sizeof(mpmc_cell_t))))
+        ERR("malloc");
+    for (size_t i = 0; i < capacity; i++)
+        queue->cells[i].sequence = i;
+    queue->mask = capacity - 1;
+    queue->enqueue_position = 0;
+    queue->dequeue_position = 0;
+}
+
+void mpmc_destroy(mpmc_queue_t *queue)
+{
+    free(queue->cells);
+}
+
+/// @brief Append a value to the queue
+/// @return 0 on success, -1 if the queue is full
+int mpmc_push(mpmc_queue_t *queue, void *value)
+{
+    size_t position = __atomic_load_n(&queue->enqueue_position, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        mpmc_cell_t *cell = &queue->cells[position & queue->mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if (0 == difference)
+        {
+            // The cell is free, claim it (on failure position is reloaded)
+            if (__atomic_compare_exchange_n(&queue->enqueue_position, &position, position + 1, 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            {
+                cell->value = value;
+                __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+        }
+        else if (difference < 0)
+            return -1;
+        else
+            position = __atomic_load_n(&queue->enqueue_position, __ATOMIC_RELAXED);
+    }
+}
+
+/// @brief Take the oldest value from the queue
+/// @return 0 on success, -1 if the queue is empty
+int mpmc_pop(mpmc_queue_t *queue, void **value)
+{
+    size_t position = __atomic_load_n(&queue->dequeue_position, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        mpmc_cell_t *cell = &queue->cells[position & queue->mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+        if (0 == difference)
+        {
+            if (__atomic_compare_exchange_n(&queue->dequeue_position, &position, position + 1, 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            {
+                *value = cell->value;
+                __atomic_store_n(&cell->sequence, position + queue->mask + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+        }
+        else if (difference < 0)
+            return -1;
+        else
+            position = __atomic_load_n(&queue->dequeue_position, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Completion queue, one per reactor
+ */
+
+typedef struct
+{
+    mpmc_queue_t queue;
+    int event_fd;  // Readable when the queue has new completions
+    int signalled; // Whether event_fd was written since the reactor last drained the queue
+} completion_queue_t;
+
+void completion_queue_init(completion_queue_t *completions, size_t capacity)
+{
+    mpmc_init(&completions->queue, capacity);
+    if ((completions->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        ERR("eventfd");
+    completions->signalled = 0;
+}
+
+void completion_queue_destroy(completion_queue_t *completions)
+{
+    mpmc_destroy(&completions->queue);
+    if (TEMP_FAILURE_RETRY(close(completions->event_fd)) < 0)
+        ERR("close");
+}
+
+/// @brief Reset the wakeup before draining the queue, so that completions pushed from now on signal again
+void completion_queue_rearm(completion_queue_t *completions)
+{
+    uint64_t count;
+    if (TEMP_FAILURE_RETRY(read(completions->event_fd, &count, sizeof(count))) < 0 && EAGAIN != errno)
+        ERR("read");
+    __atomic_store_n(&completions->signalled, 0, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Worker pool
+ */
+
+/// @brief Header of every job, the pool reports the finished job to its completion queue
+typedef struct
+{
+    completion_queue_t *completions;
+} pool_job_t;
+
+typedef struct
+{
+    mpmc_queue_t jobs;
+    sem_t ready; // Counts the jobs in the queue, idle workers sleep on it
+    int stop;
+    void (*work)(pool_job_t *job);
+    int n_workers;
+    pthread_t *workers;
+} worker_pool_t;
+
+void *worker_work(void *args)
+{
+    worker_pool_t *pool = args;
+    for (;;)
+    {
+        if (TEMP_FAILURE_RETRY(sem_wait(&pool->ready)) < 0)
+            ERR("sem_wait");
+        if (__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE))
+            return NULL;
+
+        pool_job_t *job;
+        while (mpmc_pop(&pool->jobs, (void **)&job) < 0)
+            sched_yield(); // A producer claimed the cell but did not publish the job yet
+        pool->work(job);
+
+        completion_queue_t *completions = job->completions;
+        while (mpmc_push(&completions->queue, job) < 0)
+        {
+            // The reactor is behind, it drains the queue on its next wakeup (unless the server is stopping)
+            if (__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE))
+                return NULL;
+            sched_yield();
+        }
+        if (0 == __atomic_exchange_n(&completions->signalled, 1, __ATOMIC_SEQ_CST))
+        {
+            uint64_t one = 1;
+            if (TEMP_FAILURE_RETRY(write(completions->event_fd, &one, sizeof(one))) < 0)
+                ERR("write");
+        }
+    }
+}
+
+/// @brief Start a pool of workers
+/// @param pool Pool
+/// @param n_workers Number of worker threads
+/// @param capacity Maximal number of queued jobs, a power of two
+/// @param work Function performing a job
+void worker_pool_init(worker_pool_t *pool, int n_workers, size_t capacity, void (*work)(pool_job_t *))
+{
+    mpmc_init(&pool->jobs, capacity);
+    if (sem_init(&pool->ready, 0, 0) < 0)
+        ERR("sem_init");
+    pool->stop = 0;
+    pool->work = work;
+    pool->n_workers = n_workers;
+    if (NULL == (pool->workers = malloc(n_workers * sizeof(pthread_t))))
+        ERR("malloc");
+    for (int i = 0; i < n_workers; i++)
+        if (pthread_create(&pool->workers[i], NULL, worker_work, pool))
+            ERR("pthread_create");
+}
+
+/// @brief Hand a job to the pool
+/// @return 0 on success, -1 if the queue is full (the caller should perform the job itself)
+int worker_pool_submit(worker_pool_t *pool, pool_job_t *job)
+{
+    if (mpmc_push(&pool->jobs, job) < 0)
+        return -1;
+    if (sem_post(&pool->ready) < 0)
+        ERR("sem_post");
+    return 0;
+}
+
+/// @brief Stop the workers (jobs still queued are abandoned) and free the pool
+void worker_pool_destroy(worker_pool_t *pool)
+{
+    __atomic_store_n(&pool->stop, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < pool->n_workers; i++)
+        if (sem_post(&pool->ready) < 0)
+            ERR("sem_post");
+    for (int i = 0; i < pool->n_workers; i++)
+        if (pthread_join(pool->workers[i], NULL))
+            ERR("pthread_join");
+    free(pool->workers);
+    if (sem_destroy(&pool->ready) < 0)
+        ERR("sem_destroy");
+    mpmc_destroy(&pool->jobs);
+}
+
+#endif // SOCKETS_WORKER_POOL_H